@@ -0,0 +1,50 @@
+#include "attacks.h"
+
+// turn off warnings for this
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wall"
+#include "binpack/nnue_data_binpack_format.h"
+#pragma GCC diagnostic pop
+
+namespace Attacks {
+
+    static bool pextSupported() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("bmi2");
+    }
+
+    // PEXT is microcoded on AMD before Zen 3, hundreds of cycles on dense masks
+    static bool pextFast() {
+        return pextSupported() && !__builtin_cpu_is("bdver4") && !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2");
+    }
+
+    std::vector<std::string> available() {
+        std::vector<std::string> names{"magic"};
+
+        if (pextSupported()) {
+            names.push_back("pext");
+        }
+        return names;
+    }
+
+    std::string fastest() {
+        return pextFast() ? "pext" : "magic";
+    }
+
+    bool select(const std::string& name) {
+        if (name == "magic") {
+            chess::bb::pext::g_enabled = false;
+            return true;
+        }
+        if (name == "pext" && pextSupported()) {
+            chess::bb::pext::init();
+            return true;
+        }
+        return false;
+    }
+
+    const char* name() {
+        return chess::bb::pext::g_enabled ? "pext" : "magic";
+    }
+
+} // namespace Attacks
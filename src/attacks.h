@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Sliding piece attacks of the binpack move decoder, every move of a chain is decoded from them.
+// Fancy magics run everywhere, PEXT indexed tables skip the multiply and shift on CPUs with a fast
+// BMI2 PEXT. The backend is picked once at startup, before any data is read.
+namespace Attacks {
+    // Backends this CPU supports, magic first
+    std::vector<std::string> available();
+
+    // The backend to use by default, pext where PEXT is fast
+    std::string fastest();
+
+    // Selects a backend by name, returns false if it is not supported here
+    bool select(const std::string& name);
+
+    const char* name();
+} // namespace Attacks
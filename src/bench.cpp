@@ -0,0 +1,626 @@
+#include "bench.h"
+#include "attacks.h"
+#include "dataloader.h"
+#include "kernels.h"
+#include "memory.h"
+#include "misc.h"
+#include "nn.h"
+#include "trainer.h"
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace Bench {
+
+    // Gradient copies reduced by the optimizer benchmarks, fixed so results compare across hosts
+    constexpr int BENCH_THREADS = 8;
+
+    struct Sample {
+        Features  features;
+        NN::Color stm;
+        float     expected;
+    };
+
+    static std::vector<Sample> randomSamples(int count, std::mt19937& gen) {
+        std::uniform_int_distribution<int>   rowDistribution(0, INPUT_SIZE - 1);
+        std::uniform_int_distribution<int>   countDistribution(2, 32);
+        std::uniform_real_distribution<float> expectedDistribution(0.0f, 1.0f);
+
+        std::vector<Sample> samples(count);
+        for (auto& sample : samples) {
+            sample.features.clear();
+            sample.stm      = gen() & 1;
+            sample.expected = expectedDistribution(gen);
+
+            const int n = countDistribution(gen);
+            for (int i = 0; i < n; ++i) {
+                sample.features.add(rowDistribution(gen), rowDistribution(gen));
+            }
+        }
+        return samples;
+    }
+
+    // Optimizer state of the row benchmarks, M and V apart as in NNGradients
+    struct Moments {
+        std::vector<float> m;
+        std::vector<float> v;
+
+        explicit Moments(const std::size_t size = 0) : m(size), v(size) {}
+    };
+
+    // Largest difference relative to the largest magnitude of the reference
+    static float maxDifference(const float* reference, const float* values, std::size_t size) {
+        float diff      = 0;
+        float magnitude = 1e-12f;
+        for (std::size_t i = 0; i < size; ++i) {
+            diff      = std::max(diff, std::abs(reference[i] - values[i]));
+            magnitude = std::max(magnitude, std::abs(reference[i]));
+        }
+        return diff / magnitude;
+    }
+
+    static float stateDifference(const Moments& reference, const Moments& state) {
+        return std::max(maxDifference(reference.m.data(), state.m.data(), state.m.size()), maxDifference(reference.v.data(), state.v.data(), state.v.size()));
+    }
+
+    static float gradientDifference(const BatchGradients& reference, const BatchGradients& gradients) {
+        float diff = 0;
+        for (const int row : reference.touchedRows) {
+            const std::size_t offset = std::size_t(row) * HIDDEN_SIZE;
+            diff = std::max(diff, maxDifference(reference.inputFeatures.data() + offset, gradients.inputFeatures.data() + offset, HIDDEN_SIZE));
+        }
+        diff = std::max(diff, maxDifference(reference.inputBias.data(), gradients.inputBias.data(), HIDDEN_SIZE));
+        diff = std::max(diff, maxDifference(reference.hiddenFeatures.data(), gradients.hiddenFeatures.data(), HIDDEN_SIZE * 2));
+        diff = std::max(diff, maxDifference(reference.hiddenBias.data(), gradients.hiddenBias.data(), OUTPUT_SIZE));
+        return diff;
+    }
+
+    // Runs the samples through the fused step of the given kernels, returns samples per second. With a
+    // prefetch distance the rows of the sample that many ahead are prefetched as in Trainer::batch.
+    static std::uint64_t fusedSteps(const Kernels::Table& table, const NN& nn, const std::vector<Sample>& batch, BatchGradients& gradients, std::vector<float>& outputs, const int prefetchDistance = 0) {
+        const std::uint64_t start = Misc::getTimeMs();
+
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            if (prefetchDistance > 0 && i + prefetchDistance < batch.size()) {
+                Kernels::prefetchWeights(nn, batch[i + prefetchDistance].features);
+                Kernels::prefetchGradients(gradients, batch[i + prefetchDistance].features);
+            }
+
+            const Features& features = batch[i].features;
+            for (int j = 0; j < features.n; ++j) {
+                gradients.touchRow(features.features[j][batch[i].stm]);
+                gradients.touchRow(features.features[j][!batch[i].stm]);
+            }
+
+            float loss;
+            outputs[i] = table.fusedStep(Kernels::view(nn), Kernels::view(features, batch[i].stm), batch[i].expected, Kernels::view(gradients), loss);
+        }
+
+        return batch.size() * 1000 / std::max<std::uint64_t>(1, Misc::getTimeMs() - start);
+    }
+
+    void kernels(int samples) {
+        std::mt19937 gen(42);
+
+        auto nn        = std::make_unique<NN>();
+        auto reference = std::make_unique<BatchGradients>();
+        auto gradients = std::make_unique<BatchGradients>();
+
+        std::normal_distribution<float> biasDistribution(0.0f, 0.5f);
+        for (auto& bias : nn->inputBias) {
+            bias = biasDistribution(gen);
+        }
+
+        const std::vector<Sample> batch = randomSamples(samples, gen);
+
+        std::vector<float> referenceOutputs(samples);
+        std::vector<float> outputs(samples);
+
+        std::cout << "Fused step vs scalar reference, " << samples << " samples, active kernels: " << Kernels::name() << std::endl;
+
+        for (const Kernels::Table* table : Kernels::available()) {
+            if (table == &Kernels::SCALAR_TABLE) {
+                const std::uint64_t speed = fusedSteps(*table, *nn, batch, *reference, referenceOutputs);
+                std::cout << "  " << std::setw(8) << std::left << table->name << std::right << std::setw(9) << speed << " samples/s" << std::endl;
+                continue;
+            }
+
+            gradients->clearAll();
+            gradients->sparsity = Sparsity{};
+            const std::uint64_t speed = fusedSteps(*table, *nn, batch, *gradients, outputs);
+
+            const Sparsity& sparsity = gradients->sparsity;
+            std::cout << "  " << std::setw(8) << std::left << table->name << std::right << std::setw(9) << speed << " samples/s"
+                      << " | output rel diff " << maxDifference(referenceOutputs.data(), outputs.data(), samples)
+                      << " | gradient rel diff " << gradientDifference(*reference, *gradients)
+                      << " | zero losses " << 100 * sparsity.zeroValues / sparsity.values << "%, skipped blocks " << 100 * sparsity.skippedBlocks / sparsity.blocks << "%" << std::endl;
+        }
+
+        // The same samples with the forward pass reading bf16, then int8 weights. The scalar run becomes
+        // the reference of the vector ones, its outputs are compared with the fp32 ones.
+        const std::vector<float> fp32Outputs = referenceOutputs;
+
+        for (const char* precision : {"bf16", "int8"}) {
+            nn->setBF16(std::string(precision) == "bf16");
+            nn->setInt8(std::string(precision) == "int8");
+
+            std::cout << "Fused step with " << precision << " input weights vs " << precision << " scalar reference" << std::endl;
+
+            for (const Kernels::Table* table : Kernels::available()) {
+                if (table == &Kernels::SCALAR_TABLE) {
+                    reference->clearAll();
+                    const std::uint64_t speed = fusedSteps(*table, *nn, batch, *reference, referenceOutputs);
+                    std::cout << "  " << std::setw(8) << std::left << table->name << std::right << std::setw(9) << speed << " samples/s"
+                              << " | output rel diff to fp32 " << maxDifference(fp32Outputs.data(), referenceOutputs.data(), samples) << std::endl;
+                    continue;
+                }
+
+                gradients->clearAll();
+                const std::uint64_t speed = fusedSteps(*table, *nn, batch, *gradients, outputs);
+
+                std::cout << "  " << std::setw(8) << std::left << table->name << std::right << std::setw(9) << speed << " samples/s"
+                          << " | output rel diff " << maxDifference(referenceOutputs.data(), outputs.data(), samples)
+                          << " | gradient rel diff " << gradientDifference(*reference, *gradients) << std::endl;
+            }
+        }
+    }
+
+    // The fused step of the active kernels at several prefetch distances, over samples of random rows
+    void prefetch(int samples) {
+        std::mt19937 gen(42);
+
+        auto nn        = std::make_unique<NN>();
+        auto gradients = std::make_unique<BatchGradients>();
+
+        const std::vector<Sample> batch = randomSamples(samples, gen);
+        std::vector<float>        outputs(samples);
+
+        std::cout << "Fused step by prefetch distance, " << samples << " samples, active kernels: " << Kernels::name() << std::endl;
+
+        std::uint64_t baseline = 0;
+        for (const int distance : {0, 1, 2, 4, 8}) {
+            gradients->clearAll();
+            fusedSteps(Kernels::active(), *nn, batch, *gradients, outputs, distance);
+
+            // The first pass warms up the gradient rows, the second one is timed
+            const std::uint64_t speed = fusedSteps(Kernels::active(), *nn, batch, *gradients, outputs, distance);
+            baseline                  = distance == 0 ? speed : baseline;
+
+            std::cout << "  distance " << std::setw(2) << distance << std::setw(9) << speed << " samples/s | "
+                      << std::fixed << std::setprecision(2) << double(speed) / std::max<std::uint64_t>(1, baseline) << "x" << std::defaultfloat << std::endl;
+        }
+    }
+
+    // Random fp32 weights and AdamW moments of size weights
+    static void randomMoments(std::vector<float>& weights, Moments& state, const std::size_t size, std::mt19937& gen) {
+        std::normal_distribution<float> distribution(0.0f, 0.1f);
+
+        weights.resize(size);
+        state = Moments(size);
+        for (std::size_t i = 0; i < size; ++i) {
+            weights[i] = distribution(gen);
+            state.m[i] = distribution(gen) * 0.01f;
+            state.v[i] = std::abs(distribution(gen)) * 0.001f;
+        }
+    }
+
+    // BENCH_THREADS copies of random gradients of size weights
+    static std::vector<std::vector<float>> randomGradients(const std::size_t size, std::mt19937& gen) {
+        std::normal_distribution<float> distribution(0.0f, 0.1f);
+
+        std::vector<std::vector<float>> threadGradients(BENCH_THREADS, std::vector<float>(size));
+        for (auto& gradients : threadGradients) {
+            for (auto& gradient : gradients) {
+                gradient = distribution(gen);
+            }
+        }
+        return threadGradients;
+    }
+
+    // The row of every gradient copy at offset
+    static std::array<const float*, BENCH_THREADS> rowGradients(const std::vector<std::vector<float>>& threadGradients, const std::size_t offset) {
+        std::array<const float*, BENCH_THREADS> rows;
+        for (int k = 0; k < BENCH_THREADS; ++k) {
+            rows[k] = threadGradients[k].data() + offset;
+        }
+        return rows;
+    }
+
+    // Runs step(table, weights, state, row) over `rows` input rows with every kernel table, each from a copy of the
+    // initial weights and state, and compares the tables with the scalar one. difference(reference, state) is the
+    // relative difference of two states. The scalar weights are compared with fp32Weights when it is not empty.
+    // Returns the weights of the scalar table.
+    template<typename State, typename Step, typename Difference>
+    static std::vector<float> rowSteps(const int rows, const std::vector<float>& initialWeights, const State& initialState, const Step& step, const Difference& difference,
+                                       const std::vector<float>& fp32Weights = {}) {
+        std::vector<float> referenceWeights;
+        State              referenceState;
+
+        for (const Kernels::Table* table : Kernels::available()) {
+            std::vector<float> weights = initialWeights;
+            State              state   = initialState;
+
+            const std::uint64_t start = Misc::getTimeMs();
+            for (int row = 0; row < rows; ++row) {
+                step(*table, weights.data(), state, row);
+            }
+            const std::uint64_t rowsPerSecond = std::uint64_t(rows) * 1000 / std::max<std::uint64_t>(1, Misc::getTimeMs() - start);
+
+            std::cout << "  " << std::setw(8) << std::left << table->name << std::right << std::setw(9) << rowsPerSecond << " rows/s";
+
+            if (table == &Kernels::SCALAR_TABLE) {
+                if (!fp32Weights.empty()) {
+                    std::cout << " | weight rel diff to fp32 " << maxDifference(fp32Weights.data(), weights.data(), weights.size());
+                }
+                std::cout << std::endl;
+                referenceWeights = std::move(weights);
+                referenceState   = std::move(state);
+                continue;
+            }
+
+            std::cout << " | weight rel diff " << maxDifference(referenceWeights.data(), weights.data(), weights.size())
+                      << " | state rel diff " << difference(referenceState, state) << std::endl;
+        }
+
+        return referenceWeights;
+    }
+
+    // The AdamW row kernel over `rows` input rows reduced from BENCH_THREADS gradient copies, against the scalar reference
+    void optimizer(int rows) {
+        std::mt19937 gen(42);
+
+        const std::size_t size = std::size_t(rows) * HIDDEN_SIZE;
+
+        std::vector<float> initialWeights;
+        Moments            initialState;
+        randomMoments(initialWeights, initialState, size, gen);
+
+        const std::vector<std::vector<float>> threadGradients = randomGradients(size, gen);
+
+        const Optimizer::AdamW adamW;
+
+        std::cout << "AdamW row step vs scalar reference, " << rows << " rows of " << BENCH_THREADS << " threads" << std::endl;
+
+        const std::vector<float> fp32Weights = rowSteps(
+            rows, initialWeights, initialState,
+            [&](const Kernels::Table& table, float* weights, Moments& state, const int row) {
+                const std::size_t offset = std::size_t(row) * HIDDEN_SIZE;
+                table.adamWRow(adamW, weights + offset, state.m.data() + offset, state.v.data() + offset, rowGradients(threadGradients, offset).data(), BENCH_THREADS, HIDDEN_SIZE, 0.001f);
+            },
+            stateDifference);
+
+        // The same step with 8 bit moments, the scalar run is compared with the fp32 one
+        std::vector<MomentBlock> initialBlocks(size / MOMENT_BLOCK);
+        for (std::size_t b = 0; b < initialBlocks.size(); ++b) {
+            initialBlocks[b].encode(initialState.m.data() + b * MOMENT_BLOCK, initialState.v.data() + b * MOMENT_BLOCK);
+        }
+
+        const auto decode = [](const std::vector<MomentBlock>& blocks) {
+            Moments state(blocks.size() * MOMENT_BLOCK);
+            for (std::size_t b = 0; b < blocks.size(); ++b) {
+                blocks[b].decode(state.m.data() + b * MOMENT_BLOCK, state.v.data() + b * MOMENT_BLOCK);
+            }
+            return state;
+        };
+
+        std::cout << "AdamW row step with 8 bit moments vs 8 bit scalar reference" << std::endl;
+
+        rowSteps(
+            rows, initialWeights, initialBlocks,
+            [&](const Kernels::Table& table, float* weights, std::vector<MomentBlock>& blocks, const int row) {
+                const std::size_t offset = std::size_t(row) * HIDDEN_SIZE;
+                table.adamWQuantizedRow(adamW, weights + offset, blocks.data() + offset / MOMENT_BLOCK, rowGradients(threadGradients, offset).data(), BENCH_THREADS, HIDDEN_SIZE, 0.001f);
+            },
+            [&](const std::vector<MomentBlock>& reference, const std::vector<MomentBlock>& blocks) { return stateDifference(decode(reference), decode(blocks)); },
+            fp32Weights);
+    }
+
+    // The Lion row kernel, whose state is a single momentum per weight, against the scalar reference
+    void lion(int rows) {
+        std::mt19937 gen(42);
+
+        const std::size_t size = std::size_t(rows) * HIDDEN_SIZE;
+
+        std::vector<float> initialWeights;
+        Moments            initialState;
+        randomMoments(initialWeights, initialState, size, gen);
+
+        const std::vector<std::vector<float>> threadGradients = randomGradients(size, gen);
+
+        const Optimizer::Lion lion;
+
+        std::cout << "Lion row step vs scalar reference, " << rows << " rows of " << BENCH_THREADS << " threads" << std::endl;
+
+        rowSteps(
+            rows, initialWeights, initialState.m,
+            [&](const Kernels::Table& table, float* weights, std::vector<float>& momentum, const int row) {
+                const std::size_t offset = std::size_t(row) * HIDDEN_SIZE;
+                table.lionRow(lion, weights + offset, momentum.data() + offset, rowGradients(threadGradients, offset).data(), BENCH_THREADS, HIDDEN_SIZE, 0.001f);
+            },
+            [](const std::vector<float>& reference, const std::vector<float>& momentum) { return maxDifference(reference.data(), momentum.data(), momentum.size()); });
+    }
+
+    // The AdamW lazy catch-up of `rows` input rows that missed 1 to 64 steps, against the scalar reference
+    void catchUp(int rows) {
+        std::mt19937 gen(42);
+
+        std::vector<float> initialWeights;
+        Moments            initialState;
+        randomMoments(initialWeights, initialState, std::size_t(rows) * HIDDEN_SIZE, gen);
+
+        const Optimizer::AdamW adamW;
+
+        std::cout << "AdamW row catch-up vs scalar reference, " << rows << " rows" << std::endl;
+
+        rowSteps(
+            rows, initialWeights, initialState,
+            [&](const Kernels::Table& table, float* weights, Moments& state, const int row) {
+                const std::size_t offset = std::size_t(row) * HIDDEN_SIZE;
+                table.adamWCatchUp(adamW, weights + offset, state.m.data() + offset, state.v.data() + offset, HIDDEN_SIZE, adamW.decay(1 + row % 64, 0.001f));
+            },
+            stateDifference);
+    }
+
+    // dTLB load misses of the calling thread, not available where perf events are restricted
+    class TlbMisses {
+    public:
+        TlbMisses() {
+            perf_event_attr attr{};
+            attr.size           = sizeof(attr);
+            attr.type           = PERF_TYPE_HW_CACHE;
+            attr.config         = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            attr.disabled       = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv     = 1;
+
+            fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+
+        ~TlbMisses() {
+            if (available()) {
+                close(fd);
+            }
+        }
+
+        bool available() const {
+            return fd >= 0;
+        }
+
+        void start() {
+            if (available()) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+
+        std::uint64_t stop() {
+            std::uint64_t misses = 0;
+            if (available()) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+                    misses = 0;
+                }
+            }
+            return misses;
+        }
+
+    private:
+        int fd;
+    };
+
+    // Adds `lookups` random input rows into an accumulator, as the forward pass does, once from a matrix
+    // on 4 KB pages and once from one of the arena, and reports the dTLB misses of both
+    void pages(int lookups) {
+        std::mt19937                       gen(42);
+        std::uniform_int_distribution<int> rowDistribution(0, INPUT_SIZE - 1);
+
+        std::vector<int> rows(lookups);
+        for (int& row : rows) {
+            row = rowDistribution(gen);
+        }
+
+        const std::size_t size = std::size_t(INPUT_SIZE) * HIDDEN_SIZE;
+
+        std::cout << "Random input row reads, " << lookups << " rows, transparent huge pages: " << Memory::transparentHugePages() << std::endl;
+
+        TlbMisses     counter;
+        std::uint64_t pageMisses = 0;
+
+        for (const bool hugePages : {false, true}) {
+            float* weights = static_cast<float*>(Memory::allocate(sizeof(float) * size, hugePages));
+            for (std::size_t i = 0; i < size; ++i) {
+                weights[i] = float(i % 17) * 0.01f;
+            }
+
+            alignas(64) std::array<float, HIDDEN_SIZE> accumulator{};
+
+            counter.start();
+            const std::uint64_t start = Misc::getTimeMs();
+            for (const int row : rows) {
+                Kernels::active().addRow(accumulator.data(), weights + std::size_t(row) * HIDDEN_SIZE);
+            }
+            const std::uint64_t rowsPerSecond = std::uint64_t(lookups) * 1000 / std::max<std::uint64_t>(1, Misc::getTimeMs() - start);
+            const std::uint64_t misses        = counter.stop();
+
+            const Memory::Backing backing = hugePages ? Memory::backing(weights) : Memory::Backing::Pages;
+            std::cout << "  " << std::setw(22) << std::left << Memory::name(backing) << std::right << std::setw(9) << rowsPerSecond << " rows/s";
+
+            if (counter.available()) {
+                std::cout << " | dTLB misses per row " << std::fixed << std::setprecision(3) << double(misses) / lookups << std::defaultfloat;
+            } else {
+                std::cout << " | dTLB misses n/a";
+            }
+
+            if (!hugePages) {
+                pageMisses = misses;
+            } else {
+                std::cout << " | on huge pages " << Memory::hugeBytes(weights) * 100 / (sizeof(float) * size) << "%";
+                if (counter.available() && pageMisses > 0) {
+                    std::cout << " | misses " << std::fixed << std::setprecision(1) << 100.0 * (double(pageMisses) - double(misses)) / double(pageMisses)
+                              << "% fewer" << std::defaultfloat;
+                }
+            }
+
+            std::cout << std::endl;
+
+            Memory::release(weights);
+        }
+    }
+
+    // Rook and bishop attacks of random squares on random boards of about 16 pieces, as in the middle game.
+    // Every lookup depends on the last one, so the loop times their latency as the move decoder sees it.
+    void attacks(int lookups) {
+        std::mt19937_64                    gen(42);
+        std::uniform_int_distribution<int> squareDistribution(0, 63);
+
+        std::vector<std::pair<chess::Square, chess::Bitboard>> boards(lookups);
+        for (auto& [square, occupied] : boards) {
+            square   = chess::Square(squareDistribution(gen));
+            occupied = chess::Bitboard::fromBits(gen() & gen());
+        }
+
+        const std::string active = Attacks::name();
+
+        std::cout << "Sliding attacks, " << lookups << " lookups, active: " << active << std::endl;
+
+        std::vector<chess::Bitboard> reference;
+        for (const std::string& backend : Attacks::available()) {
+            Attacks::select(backend);
+
+            std::vector<chess::Bitboard> results(lookups);
+            chess::Bitboard              last = chess::Bitboard::none();
+
+            const std::uint64_t start = Misc::getTimeMs();
+            for (int i = 0; i < lookups; ++i) {
+                const auto& [square, occupied] = boards[i];
+                last       = chess::bb::attacks<chess::PieceType::Queen>(square, occupied ^ (last & chess::bb::square(square)));
+                results[i] = last;
+            }
+            const std::uint64_t lookupsPerSecond = std::uint64_t(lookups) * 1000 / std::max<std::uint64_t>(1, Misc::getTimeMs() - start);
+
+            std::cout << "  " << std::setw(8) << std::left << backend << std::right << std::setw(11) << lookupsPerSecond << " lookups/s";
+            if (reference.empty()) {
+                reference = results;
+            } else {
+                std::size_t mismatches = 0;
+                for (int i = 0; i < lookups; ++i) {
+                    mismatches += results[i] != reference[i];
+                }
+                std::cout << " | mismatches " << mismatches;
+            }
+            std::cout << std::endl;
+        }
+
+        Attacks::select(active);
+    }
+
+    // Walks every entry as the loader does with random skipping off, so all moves are decoded and the
+    // positions played. Every backend must walk the same entries.
+    void decode(const std::string& path) {
+        DataLoader::BinpackFile file(path);
+
+        std::vector<std::span<const unsigned char>> chunks;
+        while (file.hasNextChunk()) {
+            chunks.push_back(file.nextChunk());
+        }
+
+        // The first walk faults in the pages of the mapping and is not timed
+        for (const auto& chunk : chunks) {
+            DataLoader::ChunkReader reader{chunk};
+            while (reader.next()) {
+            }
+        }
+
+        const std::string active = Attacks::name();
+
+        std::cout << "Binpack decode, " << chunks.size() << " chunks of " << path << ", active: " << active << std::endl;
+
+        for (const std::string& backend : Attacks::available()) {
+            Attacks::select(backend);
+
+            std::size_t   entries = 0;
+            std::uint64_t hash    = 0;
+
+            const std::uint64_t start = Misc::getTimeMs();
+            for (const auto& chunk : chunks) {
+                DataLoader::ChunkReader reader{chunk};
+                while (reader.next()) {
+                    hash = hash * 31 + reader.entry().pos.piecesBB().bits() + std::uint64_t(ordinal(reader.entry().move.to));
+                }
+                entries += reader.entries();
+            }
+            const std::uint64_t entriesPerSecond = std::uint64_t(entries) * 1000 / std::max<std::uint64_t>(1, Misc::getTimeMs() - start);
+
+            std::cout << "  " << std::setw(8) << std::left << backend << std::right << std::setw(11) << entriesPerSecond << " entries/s"
+                      << " | " << entries << " entries, hash " << std::hex << hash << std::dec << std::endl;
+        }
+
+        Attacks::select(active);
+    }
+
+    // Both modes start from the same weights and read the same file in file order with the filters of
+    // training. The loss of the steps is the one of the weights each sample saw, the validation batch
+    // is read with the trained weights after the untouched rows caught up.
+    void updates(const std::string& path, const int steps) {
+        constexpr std::size_t BATCH_SIZE = 4096;
+
+        std::cout << "Update modes, " << steps << " steps of " << BATCH_SIZE << " samples of " << path << ", threads: " << Tasks::threads() << std::endl;
+
+        std::vector<float> initial;
+
+        for (const UpdateMode mode : {UpdateMode::Synchronous, UpdateMode::Hogwild}) {
+            // One trainer at a time, each holds the gradients of every worker
+            const auto trainer = std::make_unique<Trainer>(path, BATCH_SIZE, path);
+            trainer->setLearningRate(0.001f);
+            trainer->setUpdateMode(mode);
+
+            if (initial.empty()) {
+                initial.assign(trainer->nn.parameters.data(), trainer->nn.parameters.data() + Parameters::SIZE);
+            } else {
+                std::memcpy(trainer->nn.parameters.data(), initial.data(), sizeof(float) * Parameters::SIZE);
+            }
+
+            double loss = 0;
+
+            const std::uint64_t start = Misc::getTimeMs();
+            for (int i = 0; i < steps; ++i) {
+                loss += trainer->step();
+            }
+            const std::uint64_t samplesPerSecond = std::uint64_t(steps) * BATCH_SIZE * 1000 / std::max<std::uint64_t>(1, Misc::getTimeMs() - start);
+
+            trainer->catchUpRows();
+
+            std::vector<float> validationLosses(Tasks::threads());
+            trainer->validationBatch(validationLosses);
+            const double validationLoss = std::accumulate(validationLosses.begin(), validationLosses.end(), 0.0) / trainer->valDataSetLoader.m_batchSize;
+
+            std::cout << "  " << std::setw(8) << std::left << (mode == UpdateMode::Hogwild ? "hogwild" : "sync") << std::right << std::setw(9) << samplesPerSecond << " samples/s"
+                      << " | loss " << std::fixed << std::setprecision(6) << loss / (double(steps) * BATCH_SIZE) << " | validation batch " << validationLoss
+                      << std::defaultfloat << std::endl;
+        }
+    }
+
+    void run(const std::string& path) {
+        kernels(16384);
+        optimizer(2048);
+        lion(2048);
+        catchUp(2048);
+        prefetch(16384);
+        pages(262144);
+        attacks(1 << 22);
+
+        if (!path.empty()) {
+            decode(path);
+            updates(path, 16);
+        }
+    }
+
+} // namespace Bench
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+
+namespace Bench {
+    // Checks the fused kernel against its scalar reference and times both
+    void kernels(int samples);
+
+    // Checks the fused reduction and optimizer step against its scalar reference and times both
+    void optimizer(int rows);
+
+    // The same for Lion
+    void lion(int rows);
+
+    // The same for the lazy catch-up of rows that missed steps
+    void catchUp(int rows);
+
+    // Times the fused kernel with the rows of later samples prefetched at several distances
+    void prefetch(int samples);
+
+    // Times random row reads on 4 KB pages and on huge pages and counts their dTLB misses
+    void pages(int lookups);
+
+    // Checks the PEXT sliding attacks against the magic ones and times both
+    void attacks(int lookups);
+
+    // Times the walk over every entry of a binpack file with each attack backend
+    void decode(const std::string& path);
+
+    // Trains steps batches of a binpack file with synchronous and with hogwild updates, and reports
+    // the samples per second and the loss of each
+    void updates(const std::string& path, int steps);
+
+    // The decode and update benchmarks only run when given a binpack file
+    void run(const std::string& path = "");
+} // namespace Bench
@@ -2770,6 +2770,56 @@ namespace chess
             }
         }
 
+        // Attack tables indexed by PEXT of the occupancy under the mask of the square, the layout of the
+        // fancy magics without their multiply and shift. PEXT is microcoded before Zen 3, so it is only
+        // used once enabled, see init().
+        namespace pext
+        {
+            inline bool g_enabled = false;
+
+            alignas(64) inline EnumArray<Square, Bitboard> g_rookMasks;
+            alignas(64) inline EnumArray<Square, const Bitboard*> g_rookAttacks;
+
+            alignas(64) inline EnumArray<Square, Bitboard> g_bishopMasks;
+            alignas(64) inline EnumArray<Square, const Bitboard*> g_bishopAttacks;
+
+            alignas(64) inline std::array<Bitboard, 102400> g_allRookAttacks;
+            alignas(64) inline std::array<Bitboard, 5248> g_allBishopAttacks;
+
+            // The instruction is emitted as is, so the callers need not be built for BMI2
+            inline std::uint64_t extract(std::uint64_t bits, std::uint64_t mask)
+            {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+                std::uint64_t result;
+                asm("pextq %2, %1, %0" : "=r"(result) : "r"(bits), "r"(mask));
+                return result;
+#else
+                std::uint64_t result = 0;
+                for (std::uint64_t bit = 1; mask != 0; bit <<= 1, mask &= mask - 1)
+                {
+                    if (bits & mask & (~mask + 1))
+                    {
+                        result |= bit;
+                    }
+                }
+                return result;
+#endif
+            }
+
+            inline Bitboard bishopAttacks(Square s, Bitboard occupied)
+            {
+                return g_bishopAttacks[s][extract(occupied.bits(), g_bishopMasks[s].bits())];
+            }
+
+            inline Bitboard rookAttacks(Square s, Bitboard occupied)
+            {
+                return g_rookAttacks[s][extract(occupied.bits(), g_rookMasks[s].bits())];
+            }
+
+            // Fills the tables and switches attacks() over to them, the CPU must support BMI2
+            inline void init();
+        }
+
         [[nodiscard]] constexpr Bitboard square(Square sq)
         {
             return Bitboard::square(sq);
@@ -2906,14 +2956,31 @@ namespace chess
 
             if constexpr (PieceTypeV == PieceType::Bishop)
             {
+                if (pext::g_enabled)
+                {
+                    return pext::bishopAttacks(sq, occupied);
+                }
+
                 return fancy_magics::bishopAttacks(sq, occupied);
             }
             else if constexpr (PieceTypeV == PieceType::Rook)
             {
+                if (pext::g_enabled)
+                {
+                    return pext::rookAttacks(sq, occupied);
+                }
+
                 return fancy_magics::rookAttacks(sq, occupied);
             }
             else if constexpr (PieceTypeV == PieceType::Queen)
             {
+                if (pext::g_enabled)
+                {
+                    return
+                        pext::bishopAttacks(sq, occupied)
+                        | pext::rookAttacks(sq, occupied);
+                }
+
                 return
                     fancy_magics::bishopAttacks(sq, occupied)
                     | fancy_magics::rookAttacks(sq, occupied);
@@ -3404,6 +3471,51 @@ namespace chess
                 initMagics<MagicsType::Bishop>(g_bishopMagics, g_allBishopAttacks, g_bishopMasks, g_bishopShifts, g_bishopAttacks);
         }
 
+        namespace pext
+        {
+            template <PieceType PieceTypeV, std::size_t SizeV>
+            inline void initTable(
+                std::array<Bitboard, SizeV>& table,
+                EnumArray<Square, Bitboard>& masks,
+                EnumArray<Square, const Bitboard*>& attacks
+            )
+            {
+                std::size_t size = 0;
+                for (Square sq : values<Square>())
+                {
+                    const Bitboard edges =
+                        ((bb::rank1 | bb::rank8) & ~Bitboard::rank(sq.rank()))
+                        | ((bb::fileA | bb::fileH) & ~Bitboard::file(sq.file()));
+
+                    Bitboard* currentAttacks = table.data() + size;
+
+                    attacks[sq] = currentAttacks;
+                    masks[sq] = chess::bb::detail::pieceSlidingAttacks<PieceTypeV>(sq, Bitboard::none()) & ~edges;
+
+                    // Walks the subsets of the mask, PEXT numbers them in the same order
+                    Bitboard occupied = Bitboard::none();
+                    do
+                    {
+                        currentAttacks[extract(occupied.bits(), masks[sq].bits())] = chess::bb::detail::pieceSlidingAttacks<PieceTypeV>(sq, occupied);
+
+                        ++size;
+                        occupied = Bitboard::fromBits(occupied.bits() - masks[sq].bits()) & masks[sq];
+                    } while (occupied.any());
+                }
+            }
+
+            inline void init()
+            {
+                static const bool initialized = []() {
+                    initTable<PieceType::Rook>(g_allRookAttacks, g_rookMasks, g_rookAttacks);
+                    initTable<PieceType::Bishop>(g_allBishopAttacks, g_bishopMasks, g_bishopAttacks);
+                    return true;
+                }();
+
+                g_enabled = initialized;
+            }
+        }
+
         [[nodiscard]] inline Bitboard between(Square s1, Square s2)
         {
             return detail::between[s1][s2];
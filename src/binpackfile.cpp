@@ -0,0 +1,88 @@
+#include "binpackfile.h"
+
+// turn off warnings for this
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wall"
+#include "binpack/nnue_data_binpack_format.h"
+#pragma GCC diagnostic pop
+
+#include <cstdint>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace DataLoader {
+
+    BinpackFile::BinpackFile(const std::string& path) : m_path{path} {
+        const int file = open(path.c_str(), O_RDONLY);
+        if (file < 0) {
+            std::cout << "Error: Couldn't open binpack file " << path << std::endl;
+            exit(1);
+        }
+
+        struct stat status;
+        if (fstat(file, &status) == 0 && status.st_size > 0) {
+            void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (data == MAP_FAILED) {
+                std::cout << "Error: Couldn't map binpack file " << path << std::endl;
+                exit(1);
+            }
+
+            m_data     = static_cast<const unsigned char*>(data);
+            m_size     = status.st_size;
+            m_modified = std::uint64_t(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+
+            // Chunks may be read in a random order, but each one front to back, so the default read
+            // ahead fits better than MADV_SEQUENTIAL, which would drop the pages behind the reader
+            madvise(data, m_size, MADV_NORMAL);
+        }
+
+        // The mapping keeps the file alive
+        close(file);
+    }
+
+    BinpackFile::~BinpackFile() {
+        if (m_data != nullptr) {
+            munmap(const_cast<unsigned char*>(m_data), m_size);
+        }
+    }
+
+    std::span<const unsigned char> BinpackFile::nextChunk() {
+        const std::span<const unsigned char> chunk = chunkAt(m_offset);
+
+        m_offset += CHUNK_HEADER_SIZE + chunk.size();
+        return chunk;
+    }
+
+    std::span<const unsigned char> BinpackFile::chunkAt(const std::size_t offset) const {
+        const unsigned char* header = m_data + offset;
+
+        if (offset + CHUNK_HEADER_SIZE > m_size || header[0] != 'B' || header[1] != 'I' || header[2] != 'N' || header[3] != 'P') {
+            std::cout << "Error: Invalid binpack chunk at offset " << offset << " of " << m_path << std::endl;
+            exit(1);
+        }
+
+        const std::size_t size = std::uint32_t(header[4]) | (std::uint32_t(header[5]) << 8) | (std::uint32_t(header[6]) << 16) | (std::uint32_t(header[7]) << 24);
+
+        if (size > binpack::maxChunkSize || offset + CHUNK_HEADER_SIZE + size > m_size) {
+            std::cout << "Error: Binpack chunk of " << size << " bytes at offset " << offset << " exceeds " << m_path << std::endl;
+            exit(1);
+        }
+
+        return {header + CHUNK_HEADER_SIZE, size};
+    }
+
+    bool BinpackFile::isChunkAt(const std::size_t offset) const {
+        if (offset > m_size || m_size - offset < CHUNK_HEADER_SIZE) {
+            return false;
+        }
+
+        const unsigned char* header = m_data + offset;
+        const std::size_t    size   = std::uint32_t(header[4]) | (std::uint32_t(header[5]) << 8) | (std::uint32_t(header[6]) << 16) | (std::uint32_t(header[7]) << 24);
+
+        return header[0] == 'B' && header[1] == 'I' && header[2] == 'N' && header[3] == 'P' && size <= binpack::maxChunkSize && offset + CHUNK_HEADER_SIZE + size <= m_size;
+    }
+
+} // namespace DataLoader
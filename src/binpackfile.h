@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+namespace DataLoader {
+
+    // Read only mapping of a binpack file. Chunks are handed out as views of the page cache, so reading
+    // them allocates and copies nothing. The format is the one of binpack::CompressedTrainingDataFile:
+    // chunks of an 8 byte header, "BINP" and the little endian size, followed by the chunk data.
+    class BinpackFile {
+    public:
+        explicit BinpackFile(const std::string& path);
+        ~BinpackFile();
+
+        BinpackFile(const BinpackFile&)            = delete;
+        BinpackFile& operator=(const BinpackFile&) = delete;
+
+        bool hasNextChunk() const {
+            return m_offset < m_size;
+        }
+
+        // The data of the next chunk, valid for the life of the file
+        std::span<const unsigned char> nextChunk();
+
+        // The data of the chunk whose header starts at offset
+        std::span<const unsigned char> chunkAt(std::size_t offset) const;
+
+        // Whether a valid chunk header starts at offset, chunkAt() exits on an invalid one
+        bool isChunkAt(std::size_t offset) const;
+
+        // Starts over at the first chunk
+        void rewind() {
+            m_offset = 0;
+        }
+
+        // Offset of the header of the next chunk
+        std::size_t offset() const {
+            return m_offset;
+        }
+
+        std::size_t size() const {
+            return m_size;
+        }
+
+        // Modification time of the file in nanoseconds
+        std::uint64_t modified() const {
+            return m_modified;
+        }
+
+        const std::string& path() const {
+            return m_path;
+        }
+
+    private:
+        std::string          m_path;
+        const unsigned char* m_data     = nullptr;
+        std::size_t          m_size     = 0;
+        std::size_t          m_offset   = 0;
+        std::uint64_t        m_modified = 0;
+    };
+
+    constexpr std::size_t CHUNK_HEADER_SIZE = 8;
+
+} // namespace DataLoader
@@ -0,0 +1,107 @@
+#include "chunkindex.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace DataLoader {
+
+    // "BPIX", the version, the size and the modification time of the indexed file and the number of
+    // chunks, followed by the chunks
+    constexpr char          INDEX_MAGIC[4]    = {'B', 'P', 'I', 'X'};
+    constexpr std::uint32_t INDEX_VERSION     = 3;
+    constexpr std::size_t   INDEX_HEADER_SIZE = 4 + 4 + 8 + 8 + 8;
+
+    ChunkIndex::ChunkIndex(BinpackFile& file) {
+        const std::string path = file.path() + ".bpidx";
+
+        if (load(path, file)) {
+            return;
+        }
+
+        build(file);
+        save(path, file);
+    }
+
+    bool ChunkIndex::load(const std::string& path, const BinpackFile& binpackFile) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return false;
+        }
+
+        const std::uint64_t bytes = file.tellg();
+        file.seekg(0);
+
+        char          magic[4];
+        std::uint32_t version  = 0;
+        std::uint64_t size     = 0;
+        std::uint64_t modified = 0;
+        std::uint64_t count    = 0;
+
+        file.read(magic, sizeof(magic));
+        file.read(reinterpret_cast<char*>(&version), sizeof(version));
+        file.read(reinterpret_cast<char*>(&size), sizeof(size));
+        file.read(reinterpret_cast<char*>(&modified), sizeof(modified));
+        file.read(reinterpret_cast<char*>(&count), sizeof(count));
+
+        if (!file || std::memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 || version != INDEX_VERSION || size != binpackFile.size() || modified != binpackFile.modified()) {
+            return false;
+        }
+
+        // The chunks must fill the rest of the sidecar exactly
+        if (bytes < INDEX_HEADER_SIZE || count != (bytes - INDEX_HEADER_SIZE) / sizeof(Chunk) || (bytes - INDEX_HEADER_SIZE) % sizeof(Chunk) != 0) {
+            return false;
+        }
+
+        m_chunks.resize(count);
+        file.read(reinterpret_cast<char*>(m_chunks.data()), sizeof(Chunk) * count);
+
+        if (!file) {
+            m_chunks.clear();
+            return false;
+        }
+
+        for (const Chunk& chunk : m_chunks) {
+            if (!binpackFile.isChunkAt(chunk.offset) || binpackFile.chunkAt(chunk.offset).size() != chunk.size) {
+                std::cout << "Chunk index " << path << " doesn't match " << binpackFile.path() << ", rebuilding it" << std::endl;
+                m_chunks.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Only the chunk headers are walked, no entry is decoded
+    void ChunkIndex::build(BinpackFile& file) {
+        m_chunks.clear();
+
+        file.rewind();
+        while (file.hasNextChunk()) {
+            const std::uint64_t offset = file.offset();
+            m_chunks.push_back({offset, file.nextChunk().size()});
+        }
+        file.rewind();
+
+        std::cout << "Indexed " << m_chunks.size() << " chunks of " << file.path() << std::endl;
+    }
+
+    // The index is only a cache, a file that can't be written is rebuilt on the next run
+    void ChunkIndex::save(const std::string& path, const BinpackFile& binpackFile) const {
+        std::ofstream file(path, std::ios::binary);
+
+        if (file) {
+            const std::uint64_t size     = binpackFile.size();
+            const std::uint64_t modified = binpackFile.modified();
+            const std::uint64_t count    = m_chunks.size();
+
+            file.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+            file.write(reinterpret_cast<const char*>(&INDEX_VERSION), sizeof(INDEX_VERSION));
+            file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+            file.write(reinterpret_cast<const char*>(&modified), sizeof(modified));
+            file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            file.write(reinterpret_cast<const char*>(m_chunks.data()), sizeof(Chunk) * count);
+        } else {
+            std::cout << "Couldn't write chunk index " << path << std::endl;
+        }
+    }
+
+} // namespace DataLoader
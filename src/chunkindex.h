@@ -0,0 +1,40 @@
+#pragma once
+
+#include "binpackfile.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace DataLoader {
+
+    // Offsets and sizes of the chunks of a binpack file. The file itself can only be walked from its
+    // start, the index makes every chunk addressable. It is kept next to the file in <path>.bpidx
+    // and rebuilt when that is missing, was written for a file of another size or modification time,
+    // or lists a chunk the file doesn't have.
+    class ChunkIndex {
+    public:
+        struct Chunk {
+            std::uint64_t offset;
+            std::uint64_t size;
+        };
+
+        // Loads the sidecar of file, or builds the index from the chunk headers and writes it
+        explicit ChunkIndex(BinpackFile& file);
+
+        std::size_t size() const {
+            return m_chunks.size();
+        }
+
+        const Chunk& operator[](const std::size_t index) const {
+            return m_chunks[index];
+        }
+
+    private:
+        bool load(const std::string& path, const BinpackFile& file);
+        void build(BinpackFile& file);
+        void save(const std::string& path, const BinpackFile& file) const;
+
+        std::vector<Chunk> m_chunks;
+    };
+
+} // namespace DataLoader
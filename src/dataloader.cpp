@@ -1,6 +1,7 @@
 #include "dataloader.h"
 #include "nn.h"
 #include <ctime>
+#include <iostream>
 
 namespace DataLoader {
 
@@ -12,58 +13,195 @@ namespace DataLoader {
         // Permute shuffle
         shuffle();
 
-#pragma omp parallel for schedule(static) num_threads(THREADS)
         // Convert entries into features
-        for (std::size_t i = 0; i < m_buffer.size(); ++i) {
-            const auto& entry = m_buffer[i];
-            m_currentData[m_permuteShuffle[i]].loadEntry(entry);
-        }
+        Tasks::pool().parallelFor(0, m_buffer.size(), 4096, [this](const int first, const int last) {
+            for (int i = first; i < last; ++i) {
+                const auto& entry = m_buffer[i];
+                m_currentData[m_permuteShuffle[i]].loadEntry(entry);
+            }
+        });
     }
 
     void DataSetLoader::loadNextBatch() {
-        m_positionIndex = std::min(m_positionIndex + m_batchSize, m_currentDataSize);
+        m_positionIndex      = std::min(m_positionIndex + m_batchSize, m_currentDataSize);
+        m_batchFeaturesReady = false;
 
         if (m_positionIndex == m_currentDataSize) {
-            if (m_readingThread.joinable()) {
-                m_readingThread.join();
-            }
+            Tasks::pool().wait(m_reading);
 
             m_positionIndex = 0;
             loadFromBuffer();
 
             if (m_backgroundLoading) {
-                m_readingThread = std::thread(&DataSetLoader::loadNext, this);
+                Tasks::pool().background(m_reading, [this]() { loadNext(); });
             } else {
                 loadNext();
             }
         }
     }
 
-    void DataSetLoader::tryFillBuffer() {
-        std::random_device          rd;
-        std::mt19937                mt{rd()};
-        double                      prob = static_cast<double>(m_random_fen_skipping) / (m_random_fen_skipping + 1);
-        std::bernoulli_distribution dist(prob);
-
-        for (std::size_t counter = 0; counter < CHUNK_SIZE; ++counter) {
-            // If we finished, go back to the beginning
-            if (!m_reader.hasNext()) {
-                m_reader = binpack::CompressedTrainingDataEntryReader(m_path);
+    // Builds the CSR view of the current batch by counting sort over the input rows,
+    // once per batch, as the trainer may already have built it during the last step
+    const BatchFeatures& DataSetLoader::loadBatchFeatures() {
+        if (m_batchFeaturesReady) {
+            return m_batchFeatures;
+        }
+
+        const std::size_t batchSize = m_batchSize;
+
+        m_batchFeatures.size = batchSize;
+        m_batchFeatures.rowOffsets.assign(INPUT_SIZE + 1, 0);
+
+        for (std::size_t i = 0; i < batchSize; ++i) {
+            const Features& features = getEntry(i).extractFeatures();
+            for (int j = 0; j < features.n; ++j) {
+                m_batchFeatures.rowOffsets[features.features[j][0] + 1]++;
+                m_batchFeatures.rowOffsets[features.features[j][1] + 1]++;
             }
+        }
 
-            // Get info
-            binpack::TrainingDataEntry entry = m_reader.next();
+        for (int row = 0; row < INPUT_SIZE; ++row) {
+            m_batchFeatures.rowOffsets[row + 1] += m_batchFeatures.rowOffsets[row];
+        }
 
-            // Skip randomly
-            if (m_random_fen_skipping && dist(mt)) {
-                continue;
+        m_batchFeatures.entries.resize(m_batchFeatures.rowOffsets[INPUT_SIZE]);
+
+        std::vector<int> cursor(m_batchFeatures.rowOffsets.begin(), m_batchFeatures.rowOffsets.end() - 1);
+
+        for (std::size_t i = 0; i < batchSize; ++i) {
+            const DataSetEntry& entry    = getEntry(i);
+            const Features&     features = entry.extractFeatures();
+            const uint8_t       stm      = entry.sideToMove();
+
+            for (int j = 0; j < features.n; ++j) {
+                m_batchFeatures.entries[cursor[features.features[j][stm]]++]  = i * 2;
+                m_batchFeatures.entries[cursor[features.features[j][!stm]]++] = i * 2 + 1;
+            }
+        }
+
+        m_batchFeaturesReady = true;
+        return m_batchFeatures;
+    }
+
+    // The loads of the constructor already read the first chunks in file order
+    void DataSetLoader::setRandomChunkOrder(const bool random) {
+        if (random == m_randomChunkOrder) {
+            return;
+        }
+
+        Tasks::pool().wait(m_reading);
+
+        m_randomChunkOrder = random;
+        m_chunkCursor      = 0;
+        m_chunkOrder.clear();
+        m_pending.clear();
+        init();
+    }
+
+    std::vector<std::span<const unsigned char>> DataSetLoader::readChunks(const int count) {
+        if (m_index.size() == 0) {
+            std::cout << "Error: No training data in " << m_path << std::endl;
+            exit(1);
+        }
+
+        std::vector<std::span<const unsigned char>> chunks;
+
+        for (int i = 0; i < count; ++i) {
+            chunks.push_back(m_file.chunkAt(m_index[nextChunk()].offset));
+        }
+        return chunks;
+    }
+
+    std::size_t DataSetLoader::nextChunk() {
+        const std::size_t pass     = m_chunkCursor / m_index.size();
+        const std::size_t position = m_chunkCursor % m_index.size();
+
+        m_chunkCursor++;
+
+        if (!m_randomChunkOrder) {
+            return position;
+        }
+
+        if (m_chunkOrder.size() != m_index.size() || m_chunkPass != pass) {
+            m_chunkOrder.resize(m_index.size());
+            std::iota(m_chunkOrder.begin(), m_chunkOrder.end(), 0);
+
+            std::mt19937_64 rng{m_chunkSeed + pass};
+            std::shuffle(m_chunkOrder.begin(), m_chunkOrder.end(), rng);
+            m_chunkPass = pass;
+        }
+
+        return m_chunkOrder[position];
+    }
+
+    // The chunk layout of CompressedTrainingDataEntryReader: packed entries, each followed by the
+    // number of plies and the movetext of the chain of positions played from it
+    bool ChunkReader::advance() {
+        if (m_chain && m_chain->hasNext()) {
+            // PackedMoveScoreListReader::nextEntry without the copy of the entry
+            binpack::TrainingDataEntry& entry = m_chain->entry;
+            entry.pos.doMove(entry.move);
+
+            const auto [move, score] = m_chain->nextMoveScore(entry.pos);
+            entry.move   = move;
+            entry.score  = score;
+            entry.ply   += 1;
+            entry.result = -entry.result;
+
+            m_entries++;
+            return true;
+        }
+
+        if (m_chain) {
+            m_offset += m_chain->numReadBytes();
+            m_chain.reset();
+        }
+
+        if (m_offset + sizeof(binpack::PackedTrainingDataEntry) + 2 > m_chunk.size()) {
+            return false;
+        }
+
+        binpack::PackedTrainingDataEntry packed;
+        std::memcpy(&packed, m_chunk.data() + m_offset, sizeof(binpack::PackedTrainingDataEntry));
+        m_offset += sizeof(binpack::PackedTrainingDataEntry);
+
+        const std::uint16_t numPlies = (m_chunk[m_offset] << 8) | m_chunk[m_offset + 1];
+        m_offset += 2;
+
+        // The movetext is only read, the reader merely takes a mutable pointer
+        m_chain.emplace(binpack::unpackEntry(packed), const_cast<unsigned char*>(m_chunk.data()) + m_offset, numPlies);
+
+        m_entries++;
+        return true;
+    }
+
+    bool ChunkReader::skip(const std::size_t count) {
+        for (std::size_t i = 0; i <= count; ++i) {
+            if (!advance()) {
+                return false;
             }
+        }
+        return true;
+    }
+
+    // Skipped entries are never copied or filtered, the cheap filters go first
+    void DataSetLoader::decodeChunk(const std::span<const unsigned char> chunk, std::vector<binpack::TrainingDataEntry>& entries, std::size_t& decoded) const {
+        ChunkReader reader{chunk};
+        Sampler     sampler{m_random_fen_skipping};
+
+        while (reader.skip(m_random_fen_skipping ? sampler.next() : 0)) {
+            const binpack::TrainingDataEntry& entry = reader.entry();
 
             // Skip if the entry is too early
             if (entry.ply <= 16) {
                 continue;
             }
 
+            // Skip if the entry score is none
+            if (entry.score == VALUE_NONE) {
+                continue;
+            }
+
             // Skip if the entry is a capturing move
             if (entry.isCapturingMove()) {
                 continue;
@@ -74,21 +212,49 @@ namespace DataLoader {
                 continue;
             }
 
-            // Skip if the entry score is none
-            if (entry.score == VALUE_NONE) {
-                continue;
-            }
+            entries.push_back(entry);
+        }
 
-            m_buffer.push_back(entry);
+        decoded += reader.entries();
+    }
+
+    // Reads CHUNK_SIZE positions. Binpack chunks are independent, so every worker decodes whole chunks
+    // of a round of one chunk per worker, and the entries are appended in file order.
+    void DataSetLoader::tryFillBuffer() {
+        std::size_t decoded = 0;
+
+        while (decoded < CHUNK_SIZE && m_buffer.size() < CHUNK_SIZE) {
+            const std::vector<std::span<const unsigned char>> chunks = readChunks(Tasks::threads());
+
+            std::vector<std::vector<binpack::TrainingDataEntry>> entries(chunks.size());
+            std::vector<std::size_t>                             counts(chunks.size(), 0);
+
+            Tasks::pool().parallelFor(0, int(chunks.size()), 1, [&](const int first, const int last) {
+                for (int i = first; i < last; ++i) {
+                    decodeChunk(chunks[i], entries[i], counts[i]);
+                }
+            });
+
+            for (std::size_t i = 0; i < chunks.size(); ++i) {
+                decoded += counts[i];
+                m_buffer.insert(m_buffer.end(), entries[i].begin(), entries[i].end());
+            }
         }
     }
 
     void DataSetLoader::loadNext() {
-        m_buffer.clear();
+        m_buffer.assign(m_pending.begin(), m_pending.end());
+        m_pending.clear();
 
         while(m_buffer.size() < m_batchSize){
             tryFillBuffer();
         }
+
+        // m_currentData holds CHUNK_SIZE entries
+        if (m_buffer.size() > CHUNK_SIZE) {
+            m_pending.assign(m_buffer.begin() + CHUNK_SIZE, m_buffer.end());
+            m_buffer.resize(CHUNK_SIZE);
+        }
     }
 
     void DataSetLoader::init() {
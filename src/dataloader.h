@@ -1,6 +1,10 @@
 #pragma once
 
+#include "binpackfile.h"
+#include "chunkindex.h"
+#include "memory.h"
 #include "nn.h"
+#include "tasks.h"
 #include "types.h"
 
 // turn off warnings for this
@@ -13,10 +17,10 @@
 #include <array>
 #include <fstream>
 #include <numeric>
+#include <optional>
 #include <random>
 #include <sstream>
 #include <string>
-#include <thread>
 
 constexpr std::size_t CHUNK_SIZE = (1 << 20);
 
@@ -26,6 +30,57 @@ namespace DataLoader {
 
     void loadFeatures(const binpack::TrainingDataEntry& entry, Features& features);
 
+    // Walks the entries of one binpack chunk in file order. The positions of a movetext chain are
+    // advanced in place, the move must still be played for the next one to decode, but an entry is
+    // only copied out by a caller keeping it.
+    class ChunkReader {
+    public:
+        explicit ChunkReader(const std::span<const unsigned char> chunk) : m_chunk{chunk} {}
+
+        // Moves past count entries onto the next one, false at the end of the chunk
+        bool skip(std::size_t count);
+
+        bool next() {
+            return skip(0);
+        }
+
+        // The current entry, valid until the reader moves
+        const binpack::TrainingDataEntry& entry() const {
+            return m_chain->entry;
+        }
+
+        // Entries walked so far, skipped or not
+        std::size_t entries() const {
+            return m_entries;
+        }
+
+    private:
+        bool advance();
+
+        std::span<const unsigned char> m_chunk;
+        std::size_t                    m_offset  = 0;
+        std::size_t                    m_entries = 0;
+
+        // The chain of the current entry, its reader holds the entry
+        std::optional<binpack::PackedMoveScoreListReader> m_chain;
+    };
+
+    // Random skipping keeps each entry with probability 1 / (skipping + 1). The number of entries
+    // skipped before a kept one is then geometric, so it is drawn once per kept entry.
+    class Sampler {
+    public:
+        explicit Sampler(const int skipping) : m_mt{std::random_device{}()}, m_gap{1.0 / (skipping + 1)} {}
+
+        // Entries to skip before the next one kept
+        std::size_t next() {
+            return m_gap(m_mt);
+        }
+
+    private:
+        std::mt19937                             m_mt;
+        std::geometric_distribution<std::size_t> m_gap;
+    };
+
     struct DataSetEntry {
     private:
         int16_t  _score;
@@ -58,49 +113,78 @@ namespace DataLoader {
         }
     };
 
-    struct DataSetLoader {
+    struct DataSetLoader : Memory::Arena {
         std::array<DataSetEntry, CHUNK_SIZE> m_currentData;
         std::vector<std::size_t>             m_permuteShuffle;
 
-        binpack::CompressedTrainingDataEntryReader m_reader;
-        std::string                                m_path;
-        std::size_t                                m_batchSize     = 16384;
-        std::size_t                                m_positionIndex = 0;
+        BinpackFile m_file;
+        ChunkIndex  m_index;
+        std::string m_path;
+        std::size_t m_batchSize     = 16384;
+        std::size_t m_positionIndex = 0;
 
-        std::thread m_readingThread;
+        // The read of the next chunk, a background task of the shared pool
+        Tasks::Group m_reading;
 
         bool m_backgroundLoading = true;
 
+        // Every pass over the file reads the chunks in file order, or with random chunk order in an
+        // order drawn from the seed and the pass. The cursor counts the chunks read so far, including
+        // the ones of the loads ahead.
+        bool                     m_randomChunkOrder = false;
+        std::uint64_t            m_chunkSeed        = std::random_device{}();
+        std::size_t              m_chunkCursor      = 0;
+        std::vector<std::size_t> m_chunkOrder;
+        std::size_t              m_chunkPass        = 0;
+
         int m_random_fen_skipping = 16;
         int m_early_fen_skipping  = 16;
 
         std::vector<binpack::TrainingDataEntry> m_buffer;
 
+        // Entries of the last round of chunks beyond CHUNK_SIZE, the next load starts with them
+        std::vector<binpack::TrainingDataEntry> m_pending;
+
+        BatchFeatures m_batchFeatures;
+        bool          m_batchFeaturesReady = false;
+
         std::size_t m_currentDataSize = 0;
 
-        DataSetLoader(const std::string& _path) : m_reader{_path}, m_path{_path} {
+        DataSetLoader(const std::string& _path) : m_file{_path}, m_index{m_file}, m_path{_path} {
             m_buffer.reserve(CHUNK_SIZE);
             m_permuteShuffle.reserve(CHUNK_SIZE);
             init();
         }
 
-        DataSetLoader(const std::string& _path, const std::size_t _batchSize) : m_reader{_path}, m_path{_path}, m_batchSize{_batchSize} {
+        DataSetLoader(const std::string& _path, const std::size_t _batchSize) : m_file{_path}, m_index{m_file}, m_path{_path}, m_batchSize{_batchSize} {
             m_buffer.reserve(CHUNK_SIZE);
             m_permuteShuffle.reserve(CHUNK_SIZE);
             init();
         }
 
-        DataSetLoader(const std::string& _path, const std::size_t _batchSize, const bool _backgroundLoading) : m_reader{_path}, m_path{_path}, m_batchSize{_batchSize}, m_backgroundLoading{_backgroundLoading} {
+        DataSetLoader(const std::string& _path, const std::size_t _batchSize, const bool _backgroundLoading) : m_file{_path}, m_index{m_file}, m_path{_path}, m_batchSize{_batchSize}, m_backgroundLoading{_backgroundLoading} {
             m_buffer.reserve(CHUNK_SIZE);
             m_permuteShuffle.reserve(CHUNK_SIZE);
             init();
         }
 
+        ~DataSetLoader() {
+            Tasks::pool().wait(m_reading);
+        }
+
+        // Restarts the reads from the first pass in the given chunk order
+        void setRandomChunkOrder(bool random);
+        // Views of count binpack chunks, starting a new pass at the end of the file
+        std::vector<std::span<const unsigned char>> readChunks(int count);
+        std::size_t nextChunk();
+        // Samples the entries of one chunk and keeps the ones passing the filters, decoded counts all of them
+        void decodeChunk(std::span<const unsigned char> chunk, std::vector<binpack::TrainingDataEntry>& entries, std::size_t& decoded) const;
         void tryFillBuffer();
         void loadFromBuffer();
         void loadNext();
         void loadNextBatch();
         void init();
+        const BatchFeatures& loadBatchFeatures();
         void shuffle() {
             m_permuteShuffle.resize(m_currentDataSize);
             std::iota(m_permuteShuffle.begin(), m_permuteShuffle.end(), 0);
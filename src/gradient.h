@@ -1,51 +1,233 @@
 #pragma once
 
+#include "memory.h"
+#include "parameters.h"
+#include "tasks.h"
 #include "types.h"
 #include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <cstring>
+#include <vector>
 
-struct Gradient {
-    float M = 0;
-    float V = 0;
+// Number of weights sharing the scales of a MomentBlock
+constexpr int MOMENT_BLOCK = 64;
 
-    void clear() {
-        M = 0;
-        V = 0;
+// Adam moments of MOMENT_BLOCK weights in 8 bits each, 2.1 instead of 8 bytes per weight.
+// Both codes are companded so small values keep resolution next to the block maximum:
+//   M       = mScale * m * |m|, m in [-127, 127], rounded to nearest
+//   sqrt(V) = vScale * v * v,   v in [0, 255],    rounded up so the step size is never overestimated
+struct MomentBlock {
+    float   mScale = 0;
+    float   vScale = 0;
+    int8_t  m[MOMENT_BLOCK];
+    uint8_t v[MOMENT_BLOCK];
+
+    void decode(float* M, float* V) const {
+        for (int i = 0; i < MOMENT_BLOCK; ++i) {
+            const float root = vScale * (v[i] * v[i]);
+            M[i]             = mScale * (m[i] * std::abs(m[i]));
+            V[i]             = root * root;
+        }
+    }
+
+    void encode(const float* M, const float* V) {
+        float maxM    = 0;
+        float maxRoot = 0;
+        for (int i = 0; i < MOMENT_BLOCK; ++i) {
+            maxM    = std::max(maxM, std::abs(M[i]));
+            maxRoot = std::max(maxRoot, std::sqrt(V[i]));
+        }
+
+        mScale = maxM / (127.0f * 127.0f);
+        vScale = maxRoot / (255.0f * 255.0f);
+
+        const float mInverse = maxM > 0 ? 1 / mScale : 0;
+        const float vInverse = maxRoot > 0 ? 1 / vScale : 0;
+
+        for (int i = 0; i < MOMENT_BLOCK; ++i) {
+            const float code = std::nearbyint(std::sqrt(std::abs(M[i]) * mInverse));
+            m[i]             = int8_t(std::copysign(std::min(code, 127.0f), M[i]));
+            v[i]             = uint8_t(std::min(std::ceil(std::sqrt(std::sqrt(V[i]) * vInverse)), 255.0f));
+        }
     }
 };
 
-struct NNGradients {
-    std::array<Gradient, INPUT_SIZE * HIDDEN_SIZE> inputFeatures;
-    std::array<Gradient, HIDDEN_SIZE>              inputBias;
-    std::array<Gradient, HIDDEN_SIZE * 2>          hiddenFeatures;
-    std::array<Gradient, OUTPUT_SIZE>              hiddenBias;
+static_assert(HIDDEN_SIZE % MOMENT_BLOCK == 0);
+
+// How the optimizer state of the input features is stored
+enum class StateLayout {
+    // fp32 M and V per weight
+    Moments,
+    // 8 bit MomentBlocks, the other tensors keep fp32 moments
+    QuantizedMoments,
+    // A single fp32 momentum per weight, for Lion
+    Momentum,
+};
+
+// Optimizer state as structure of arrays: M and V are arenas of the parameter layout, so the state of
+// a weight is at the offset of the weight in NN::parameters, see m() and v(). M holds the momentum of
+// momentum only optimizers and V is then empty. In the QuantizedMoments layout the input features keep
+// their moments in inputFeatureBlocks instead, and M and V only cover the tensors from INPUT_BIAS on.
+struct NNGradients : Memory::Arena {
+    Parameters::Arena           M;
+    Parameters::Arena           V;
+    Memory::Buffer<MomentBlock> inputFeatureBlocks;
+
+    // Parameter offset of M[0] and V[0]
+    std::size_t stateOffset = 0;
+
+    // Optimizer step each input row was last brought up to date at. Rows are only updated
+    // when touched, the steps they missed are caught up in closed form the next time.
+    std::array<std::int64_t, INPUT_SIZE> inputRowSteps;
 
     NNGradients() {
+        setLayout(StateLayout::Moments);
+    }
+
+    StateLayout layout() const {
+        if (!inputFeatureBlocks.empty()) {
+            return StateLayout::QuantizedMoments;
+        }
+        return V.empty() ? StateLayout::Momentum : StateLayout::Moments;
+    }
+
+    // Allocates the state in the given layout and clears it
+    void setLayout(const StateLayout layout) {
+        const std::size_t weights = std::size_t(INPUT_SIZE) * HIDDEN_SIZE;
+
+        stateOffset = layout == StateLayout::QuantizedMoments ? Parameters::INPUT_BIAS : 0;
+
+        M                  = Parameters::Arena(Parameters::SIZE - stateOffset);
+        V                  = Parameters::Arena(layout == StateLayout::Momentum ? 0 : Parameters::SIZE - stateOffset);
+        inputFeatureBlocks = Memory::Buffer<MomentBlock>(layout == StateLayout::QuantizedMoments ? weights / MOMENT_BLOCK : 0);
+        clear();
+    }
+
+    // State of the parameter at offset
+    float* m(const std::size_t offset) {
+        return M.data() + (offset - stateOffset);
+    }
+
+    float* v(const std::size_t offset) {
+        return V.data() + (offset - stateOffset);
+    }
+
+    // The workers first touch the state in slices, see Tasks::firstTouch
+    void clear() {
+        Tasks::firstTouch(M.data(), sizeof(float) * M.size());
+        if (!V.empty()) {
+            Tasks::firstTouch(V.data(), sizeof(float) * V.size());
+        }
+        Tasks::firstTouch(inputFeatureBlocks.data(), sizeof(MomentBlock) * inputFeatureBlocks.size());
+        std::memset(inputRowSteps.data(), 0, sizeof(std::int64_t) * INPUT_SIZE);
+    }
+
+    // Brings the step of a row up to step unless it is already there, returns the step it was at.
+    // Relaxed atomics, as Hogwild threads catch up the same rows concurrently.
+    std::int64_t advanceRow(const int row, const std::int64_t step) {
+        std::atomic_ref<std::int64_t> rowStep(inputRowSteps[row]);
+
+        std::int64_t last = rowStep.load(std::memory_order_relaxed);
+        while (last < step && !rowStep.compare_exchange_weak(last, step, std::memory_order_relaxed)) {
+        }
+        return last;
+    }
+};
+
+// Zero hidden losses seen by the backward pass. SCReLU has no slope outside (0, 1), so the losses of those
+// neurons are zero and the blocks of them are skipped when the losses are added into the gradient rows.
+// A block is one vector register of the active kernels.
+struct Sparsity {
+    std::uint64_t values        = 0;
+    std::uint64_t zeroValues    = 0;
+    std::uint64_t blocks        = 0;
+    std::uint64_t skippedBlocks = 0;
+
+    void merge(const Sparsity& other) {
+        values += other.values;
+        zeroValues += other.zeroValues;
+        blocks += other.blocks;
+        skippedBlocks += other.skippedBlocks;
+    }
+};
+
+// Gradients of the dense layers of one thread in hogwild mode, which has no BatchGradients
+struct alignas(64) DenseGradients {
+    std::array<float, HIDDEN_SIZE>     inputBias;
+    std::array<float, HIDDEN_SIZE * 2> hiddenFeatures;
+    float                              hiddenBias;
+
+    DenseGradients() {
         clear();
     }
 
     void clear() {
-        std::memset(inputFeatures.data(), 0, sizeof(Gradient) * INPUT_SIZE * HIDDEN_SIZE);
-        std::memset(inputBias.data(), 0, sizeof(Gradient) * HIDDEN_SIZE);
-        std::memset(hiddenFeatures.data(), 0, sizeof(Gradient) * HIDDEN_SIZE * 2);
-        std::memset(hiddenBias.data(), 0, sizeof(Gradient) * OUTPUT_SIZE);
+        std::memset(inputBias.data(), 0, sizeof(float) * HIDDEN_SIZE);
+        std::memset(hiddenFeatures.data(), 0, sizeof(float) * HIDDEN_SIZE * 2);
+        hiddenBias = 0;
     }
 };
 
-struct BatchGradients {
+struct BatchGradients : Memory::Arena {
     std::array<float, INPUT_SIZE * HIDDEN_SIZE> inputFeatures;
     std::array<float, HIDDEN_SIZE>              inputBias;
     std::array<float, HIDDEN_SIZE * 2>          hiddenFeatures;
     std::array<float, OUTPUT_SIZE>              hiddenBias;
 
-    BatchGradients() {
-        clear();
+    // Rows of inputFeatures written since the last clear. Only these rows
+    // are cleared, reduced and updated, the rest of the matrix stays zero.
+    std::array<uint8_t, INPUT_SIZE> rowTouched;
+    std::vector<int>                touchedRows;
+
+    // Of the samples of this thread since the trainer last read it, clear() keeps it
+    Sparsity sparsity;
+
+    // With clear = false the buffers are left untouched, for the worker owning them to clear them
+    // first so their pages are placed on its NUMA node
+    explicit BatchGradients(const bool clear = true) {
+        touchedRows.reserve(INPUT_SIZE);
+        if (clear) {
+            clearAll();
+        }
     }
 
-    void clear(){
-        std::memset(inputFeatures.data(), 0, sizeof(float) * INPUT_SIZE * HIDDEN_SIZE);
+    inline void touchRow(const int row) {
+        if (!rowTouched[row]) {
+            rowTouched[row] = 1;
+            touchedRows.push_back(row);
+        }
+    }
+
+    // Clears one row once the optimizer consumed it, touchedRows still lists it until clear()
+    inline void clearRow(const int row) {
+        std::memset(inputFeatures.data() + row * HIDDEN_SIZE, 0, sizeof(float) * HIDDEN_SIZE);
+        rowTouched[row] = 0;
+    }
+
+    void clearDense() {
         std::memset(inputBias.data(), 0, sizeof(float) * HIDDEN_SIZE);
         std::memset(hiddenFeatures.data(), 0, sizeof(float) * HIDDEN_SIZE * 2);
         std::memset(hiddenBias.data(), 0, sizeof(float) * OUTPUT_SIZE);
     }
+
+    void clear(){
+        for (const int row : touchedRows) {
+            if (rowTouched[row]) {
+                clearRow(row);
+            }
+        }
+        touchedRows.clear();
+
+        clearDense();
+    }
+
+    void clearAll(){
+        std::memset(inputFeatures.data(), 0, sizeof(float) * INPUT_SIZE * HIDDEN_SIZE);
+        std::memset(rowTouched.data(), 0, sizeof(uint8_t) * INPUT_SIZE);
+        touchedRows.clear();
+
+        clearDense();
+    }
 };
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include "kernels.h"
+#include <cstring>
+
+namespace Kernels {
+
+    // Scalar reference of every kernel, plain loops that mirror the original trainer code
+
+    static float referenceForwardOutput(const Network& nn, const float* accumulator, float* activated) {
+        float output = nn.hiddenBias;
+
+        for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
+            activated[i] = SCReLU(accumulator[i]);
+        }
+
+        for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
+            output += nn.hiddenFeatures[i] * activated[i];
+        }
+
+        return output;
+    }
+
+    static inline float weightValue(const float x) {
+        return x;
+    }
+
+    static inline float weightValue(const uint16_t x) {
+        return fromBF16(x);
+    }
+
+    static inline float weightValue(const int8_t x) {
+        return x * (1.0f / Q1);
+    }
+
+    template<typename Weight>
+    static float referenceForward(const Network& nn, const Weight* weights, const Sample& sample, float* accumulator, float* activated) {
+        float* stmAccumulator  = accumulator;
+        float* nstmAccumulator = accumulator + HIDDEN_SIZE;
+
+        std::memcpy(stmAccumulator, nn.inputBias, sizeof(float) * HIDDEN_SIZE);
+        std::memcpy(nstmAccumulator, nn.inputBias, sizeof(float) * HIDDEN_SIZE);
+
+        for (int i = 0; i < sample.n; i++) {
+            for (int j = 0; j < HIDDEN_SIZE; j++) {
+                stmAccumulator[j] += weightValue(weights[sample.features[2 * i + sample.stm] * HIDDEN_SIZE + j]);
+                nstmAccumulator[j] += weightValue(weights[sample.features[2 * i + !sample.stm] * HIDDEN_SIZE + j]);
+            }
+        }
+
+        return referenceForwardOutput(nn, accumulator, activated);
+    }
+
+    static float referenceForward(const Network& nn, const Sample& sample, float* accumulator, float* activated) {
+        if (nn.inputFeaturesBF16) {
+            return referenceForward(nn, nn.inputFeaturesBF16, sample, accumulator, activated);
+        }
+        if (nn.inputFeaturesInt8) {
+            return referenceForward(nn, nn.inputFeaturesInt8, sample, accumulator, activated);
+        }
+        return referenceForward(nn, nn.inputFeatures, sample, accumulator, activated);
+    }
+
+    template<typename Weight>
+    static void referenceForwardBatchBlock(const Network& nn, const Weight* weights, const Batch& batch, float* accumulators, const int block) {
+        for (std::size_t half = 0; half < batch.size * 2; ++half) {
+            std::memcpy(accumulators + half * HIDDEN_SIZE + block, nn.inputBias + block, sizeof(float) * BATCH_BLOCK);
+        }
+
+        for (int row = 0; row < INPUT_SIZE; ++row) {
+            for (int e = batch.rowOffsets[row]; e < batch.rowOffsets[row + 1]; ++e) {
+                float* accumulator = accumulators + std::size_t(batch.entries[e]) * HIDDEN_SIZE + block;
+                for (int j = 0; j < BATCH_BLOCK; ++j) {
+                    accumulator[j] += weightValue(weights[row * HIDDEN_SIZE + block + j]);
+                }
+            }
+        }
+    }
+
+    static void referenceForwardBatchBlock(const Network& nn, const Batch& batch, float* accumulators, const int block) {
+        if (nn.inputFeaturesBF16) {
+            referenceForwardBatchBlock(nn, nn.inputFeaturesBF16, batch, accumulators, block);
+        } else if (nn.inputFeaturesInt8) {
+            referenceForwardBatchBlock(nn, nn.inputFeaturesInt8, batch, accumulators, block);
+        } else {
+            referenceForwardBatchBlock(nn, nn.inputFeatures, batch, accumulators, block);
+        }
+    }
+
+    static void referenceBackward(const Network& nn, const float* accumulator, const float* activated, const float outGradient, const Gradients& gradients, float* hiddenLosses) {
+        gradients.hiddenBias[0] += outGradient;
+
+        for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
+            gradients.hiddenFeatures[i] += outGradient * activated[i];
+        }
+
+        int zeroValues = 0;
+        for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
+            hiddenLosses[i] = outGradient * nn.hiddenFeatures[i] * SCReLUPrime(accumulator[i]);
+            zeroValues += hiddenLosses[i] == 0;
+        }
+
+        for (int i = 0; i < HIDDEN_SIZE; ++i) {
+            gradients.inputBias[i] += hiddenLosses[i] + hiddenLosses[i + HIDDEN_SIZE];
+        }
+
+        // Blocks of one value, the reference adds all of them
+        gradients.sparsity->values += HIDDEN_SIZE * 2;
+        gradients.sparsity->zeroValues += zeroValues;
+        gradients.sparsity->blocks += HIDDEN_SIZE * 2;
+    }
+
+    static void referenceAddRow(float* row, const float* values) {
+        for (int i = 0; i < HIDDEN_SIZE; ++i) {
+            row[i] += values[i];
+        }
+    }
+
+    template<typename Optimizer>
+    static void referenceOptimizeRow(const Optimizer& optimizer, float* weights, float* m, float* v, const float* const* rows, const int count, const int size, const float learningRate) {
+        for (int i = 0; i < size; ++i) {
+            float gradient = 0;
+            for (int k = 0; k < count; ++k) {
+                gradient += rows[k][i];
+            }
+            optimizer.update(weights[i], m[i], v[i], gradient, learningRate);
+        }
+    }
+
+    template<typename Optimizer>
+    static void referenceOptimizeMomentumRow(const Optimizer& optimizer, float* weights, float* momentum, const float* const* rows, const int count, const int size, const float learningRate) {
+        for (int i = 0; i < size; ++i) {
+            float gradient = 0;
+            for (int k = 0; k < count; ++k) {
+                gradient += rows[k][i];
+            }
+            optimizer.update(weights[i], momentum[i], gradient, learningRate);
+        }
+    }
+
+    template<typename Optimizer>
+    static void referenceOptimizeQuantizedRow(const Optimizer& optimizer, float* weights, MomentBlock* blocks, const float* const* rows, const int count, const int size, const float learningRate) {
+        for (int b = 0; b < size / MOMENT_BLOCK; ++b) {
+            std::array<const float*, MAX_THREADS> blockRows;
+            for (int k = 0; k < count; ++k) {
+                blockRows[k] = rows[k] + b * MOMENT_BLOCK;
+            }
+
+            std::array<float, MOMENT_BLOCK> m;
+            std::array<float, MOMENT_BLOCK> v;
+            blocks[b].decode(m.data(), v.data());
+
+            referenceOptimizeRow(optimizer, weights + b * MOMENT_BLOCK, m.data(), v.data(), blockRows.data(), count, MOMENT_BLOCK, learningRate);
+
+            blocks[b].encode(m.data(), v.data());
+        }
+    }
+
+    template<typename Optimizer>
+    static void referenceCatchUpRow(const Optimizer& optimizer, float* weights, float* m, float* v, const int size, const typename Optimizer::Decay& decay) {
+        optimizer.catchUp(weights, m, v, size, decay);
+    }
+
+    template<typename Optimizer>
+    static void referenceCatchUpMomentumRow(const Optimizer& optimizer, float* weights, float* momentum, const int size, const typename Optimizer::Decay& decay) {
+        optimizer.catchUp(weights, momentum, size, decay);
+    }
+
+    static float referenceFusedStep(const Network& nn, const Sample& sample, const float expected, const Gradients& gradients, float& loss) {
+        alignas(64) NN::Accumulator accumulator;
+        alignas(64) NN::Accumulator activated;
+        alignas(64) NN::Accumulator hiddenLosses;
+
+        const float output = referenceForward(nn, sample, accumulator.data(), activated.data());
+
+        loss                    = errorFunction(output, expected);
+        const float outGradient = errorGradient(output, expected) * sigmoidPrime(output);
+
+        referenceBackward(nn, accumulator.data(), activated.data(), outGradient, gradients, hiddenLosses.data());
+
+        for (int i = 0; i < sample.n; ++i) {
+            referenceAddRow(gradients.inputFeatures + sample.features[2 * i + sample.stm] * HIDDEN_SIZE, hiddenLosses.data());
+            referenceAddRow(gradients.inputFeatures + sample.features[2 * i + !sample.stm] * HIDDEN_SIZE, hiddenLosses.data() + HIDDEN_SIZE);
+        }
+
+        return output;
+    }
+
+    const Table SCALAR_TABLE = {
+        "scalar",
+        &referenceForward,
+        &referenceForwardOutput,
+        &referenceForwardBatchBlock,
+        &referenceFusedStep,
+        &referenceBackward,
+        &referenceAddRow,
+        &referenceOptimizeRow<Optimizer::Adam>,
+        &referenceOptimizeRow<Optimizer::AdamW>,
+        &referenceOptimizeRow<Optimizer::Adamax>,
+        &referenceOptimizeQuantizedRow<Optimizer::Adam>,
+        &referenceOptimizeQuantizedRow<Optimizer::AdamW>,
+        &referenceOptimizeQuantizedRow<Optimizer::Adamax>,
+        &referenceOptimizeMomentumRow<Optimizer::Lion>,
+        &referenceCatchUpRow<Optimizer::Adam>,
+        &referenceCatchUpRow<Optimizer::AdamW>,
+        &referenceCatchUpRow<Optimizer::Adamax>,
+        &referenceCatchUpMomentumRow<Optimizer::Lion>,
+    };
+
+    std::vector<const Table*> available() {
+        __builtin_cpu_init();
+
+        std::vector<const Table*> tables{&SCALAR_TABLE};
+
+        if (__builtin_cpu_supports("sse4.1")) {
+            tables.push_back(&SSE41_TABLE);
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            tables.push_back(&AVX2_TABLE);
+        }
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")) {
+            tables.push_back(&AVX512_TABLE);
+        }
+
+        return tables;
+    }
+
+    // The widest kernels this CPU supports, picked once at startup
+    static const Table* current = available().back();
+
+    bool select(const std::string& name) {
+        for (const Table* table : available()) {
+            if (name == table->name) {
+                current = table;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const Table& active() {
+        return *current;
+    }
+
+} // namespace Kernels
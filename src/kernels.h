@@ -0,0 +1,244 @@
+#pragma once
+
+#include "gradient.h"
+#include "nn.h"
+#include "optimizer.h"
+#include "types.h"
+#include <string>
+#include <vector>
+
+// The hot loops of the trainer. Every kernel is built once per instruction set
+// (kernels_sse41.cpp, kernels_avx2.cpp, kernels_avx512.cpp) and the widest one
+// the CPU supports is picked at startup, so one binary runs on every host.
+// kernels.cpp holds the scalar reference all of them are checked against.
+namespace Kernels {
+    // Number of hidden neurons per column block of NN::forwardBatch
+    constexpr int BATCH_BLOCK = 32;
+
+    // Sums the gradients of count >= 1 threads and applies one optimizer step to size weights, m and v
+    // are their moments in NNGradients::M and NNGradients::V
+    template<typename Optimizer>
+    using OptimizeRow = void (*)(const Optimizer& optimizer, float* weights, float* m, float* v, const float* const* rows, int count, int size, float learningRate);
+
+    // As OptimizeRow, with the moments kept in 8 bit blocks, size must be a multiple of MOMENT_BLOCK
+    template<typename Optimizer>
+    using OptimizeQuantizedRow = void (*)(const Optimizer& optimizer, float* weights, MomentBlock* blocks, const float* const* rows, int count, int size, float learningRate);
+
+    // As OptimizeRow, for optimizers keeping a single momentum per weight
+    template<typename Optimizer>
+    using OptimizeMomentumRow = void (*)(const Optimizer& optimizer, float* weights, float* momentum, const float* const* rows, int count, int size, float learningRate);
+
+    // Applies the steps a row missed while it had no gradient, size must be a multiple of 16
+    template<typename Optimizer>
+    using CatchUpRow = void (*)(const Optimizer& optimizer, float* weights, float* m, float* v, int size, const typename Optimizer::Decay& decay);
+
+    template<typename Optimizer>
+    using CatchUpMomentumRow = void (*)(const Optimizer& optimizer, float* weights, float* momentum, int size, const typename Optimizer::Decay& decay);
+
+    // Raw views of what the kernels read and write. The vector kernels are built with wider instructions
+    // than the rest of the program, so they take no containers: an inline member of std::array, std::span
+    // or NN called from them would be emitted into their object, and the linker may keep that copy for
+    // every caller. The views are built by the callers, see view().
+    struct Network {
+        // The input weights in the precision the forward pass reads, the other two are null
+        const float*    inputFeatures;
+        const uint16_t* inputFeaturesBF16;
+        const int8_t*   inputFeaturesInt8;
+        const float*    inputBias;
+        const float*    hiddenFeatures;
+        float           hiddenBias;
+    };
+
+    struct Sample {
+        // n pairs of the white and the black feature
+        const int16_t* features;
+        int            n;
+        NN::Color      stm;
+    };
+
+    struct Gradients {
+        float*    inputFeatures;
+        float*    inputBias;
+        float*    hiddenFeatures;
+        float*    hiddenBias;
+        Sparsity* sparsity;
+    };
+
+    struct Batch {
+        std::size_t size;
+        const int*  rowOffsets;
+        const int*  entries;
+    };
+
+    static_assert(sizeof(Features::features) == sizeof(int16_t) * 2 * 32, "Sample reads the features as a flat array");
+
+    inline Network view(const NN& nn) {
+        return {nn.isBF16() || nn.isInt8() ? nullptr : nn.inputFeatures.data(),
+                nn.isBF16() ? nn.inputFeaturesBF16.data() : nullptr,
+                nn.isInt8() ? nn.inputFeaturesInt8.data() : nullptr,
+                nn.inputBias.data(),
+                nn.hiddenFeatures.data(),
+                nn.hiddenBias[0]};
+    }
+
+    inline Sample view(const Features& features, const NN::Color stm) {
+        return {features.features[0].data(), features.n, stm};
+    }
+
+    inline Gradients view(BatchGradients& gradients) {
+        return {gradients.inputFeatures.data(), gradients.inputBias.data(), gradients.hiddenFeatures.data(), gradients.hiddenBias.data(), &gradients.sparsity};
+    }
+
+    inline Batch view(const BatchFeatures& batch) {
+        return {batch.size, batch.rowOffsets.data(), batch.entries.data()};
+    }
+
+    struct Table {
+        const char* name;
+
+        // Forward pass of one sample, fills the accumulator and the activations and returns the output.
+        // Every kernel adding input rows reads the bf16 or int8 copy of the weights when the network has one.
+        float (*forward)(const Network& nn, const Sample& sample, float* accumulator, float* activated);
+
+        // Forward pass from an already computed accumulator
+        float (*forwardOutput)(const Network& nn, const float* accumulator, float* activated);
+
+        // Adds the weights of the column block starting at `block` into every accumulator of the batch using them
+        void (*forwardBatchBlock)(const Network& nn, const Batch& batch, float* accumulators, int block);
+
+        // Fused forward, loss and backward of one sample. The rows of the sample must already be touched.
+        // Registers of zero hidden losses are not added into the rows, see Sparsity.
+        float (*fusedStep)(const Network& nn, const Sample& sample, float expected, const Gradients& gradients, float& loss);
+
+        // Backward pass of the hidden layer: hidden and input bias gradients, and the hidden losses of the
+        // accumulator. hiddenLosses may point to the accumulator itself. Counts their sparsity.
+        void (*backward)(const Network& nn, const float* accumulator, const float* activated, float outGradient, const Gradients& gradients, float* hiddenLosses);
+
+        // row += values, over HIDDEN_SIZE floats. Registers of zero values are skipped.
+        void (*addRow)(float* row, const float* values);
+
+        // Fused reduction and optimizer step, one per optimizer, size must be a multiple of 16
+        OptimizeRow<Optimizer::Adam>   adamRow;
+        OptimizeRow<Optimizer::AdamW>  adamWRow;
+        OptimizeRow<Optimizer::Adamax> adamaxRow;
+
+        OptimizeQuantizedRow<Optimizer::Adam>   adamQuantizedRow;
+        OptimizeQuantizedRow<Optimizer::AdamW>  adamWQuantizedRow;
+        OptimizeQuantizedRow<Optimizer::Adamax> adamaxQuantizedRow;
+
+        OptimizeMomentumRow<Optimizer::Lion> lionRow;
+
+        // Lazy catch-up of a row, one per optimizer
+        CatchUpRow<Optimizer::Adam>   adamCatchUp;
+        CatchUpRow<Optimizer::AdamW>  adamWCatchUp;
+        CatchUpRow<Optimizer::Adamax> adamaxCatchUp;
+
+        CatchUpMomentumRow<Optimizer::Lion> lionCatchUp;
+    };
+
+    extern const Table SCALAR_TABLE;
+    extern const Table SSE41_TABLE;
+    extern const Table AVX2_TABLE;
+    extern const Table AVX512_TABLE;
+
+    // Kernels of the instruction sets this CPU supports, scalar first
+    std::vector<const Table*> available();
+
+    // Selects kernels by name, returns false if they are not supported here
+    bool select(const std::string& name);
+
+    const Table& active();
+
+    inline const char* name() {
+        return active().name;
+    }
+
+    inline void optimizeRow(const Optimizer::Adam& optimizer, float* weights, float* m, float* v, const float* const* rows, const int count, const int size, const float learningRate) {
+        active().adamRow(optimizer, weights, m, v, rows, count, size, learningRate);
+    }
+
+    inline void optimizeRow(const Optimizer::AdamW& optimizer, float* weights, float* m, float* v, const float* const* rows, const int count, const int size, const float learningRate) {
+        active().adamWRow(optimizer, weights, m, v, rows, count, size, learningRate);
+    }
+
+    inline void optimizeRow(const Optimizer::Adamax& optimizer, float* weights, float* m, float* v, const float* const* rows, const int count, const int size, const float learningRate) {
+        active().adamaxRow(optimizer, weights, m, v, rows, count, size, learningRate);
+    }
+
+    inline void optimizeRow(const Optimizer::Adam& optimizer, float* weights, MomentBlock* blocks, const float* const* rows, const int count, const int size, const float learningRate) {
+        active().adamQuantizedRow(optimizer, weights, blocks, rows, count, size, learningRate);
+    }
+
+    inline void optimizeRow(const Optimizer::AdamW& optimizer, float* weights, MomentBlock* blocks, const float* const* rows, const int count, const int size, const float learningRate) {
+        active().adamWQuantizedRow(optimizer, weights, blocks, rows, count, size, learningRate);
+    }
+
+    inline void optimizeRow(const Optimizer::Adamax& optimizer, float* weights, MomentBlock* blocks, const float* const* rows, const int count, const int size, const float learningRate) {
+        active().adamaxQuantizedRow(optimizer, weights, blocks, rows, count, size, learningRate);
+    }
+
+    inline void optimizeRow(const Optimizer::Lion& optimizer, float* weights, float* momentum, const float* const* rows, const int count, const int size, const float learningRate) {
+        active().lionRow(optimizer, weights, momentum, rows, count, size, learningRate);
+    }
+
+    inline void catchUpRow(const Optimizer::Adam& optimizer, float* weights, float* m, float* v, const int size, const Optimizer::Adam::Decay& decay) {
+        active().adamCatchUp(optimizer, weights, m, v, size, decay);
+    }
+
+    inline void catchUpRow(const Optimizer::AdamW& optimizer, float* weights, float* m, float* v, const int size, const Optimizer::AdamW::Decay& decay) {
+        active().adamWCatchUp(optimizer, weights, m, v, size, decay);
+    }
+
+    inline void catchUpRow(const Optimizer::Adamax& optimizer, float* weights, float* m, float* v, const int size, const Optimizer::Adamax::Decay& decay) {
+        active().adamaxCatchUp(optimizer, weights, m, v, size, decay);
+    }
+
+    inline void catchUpRow(const Optimizer::Lion& optimizer, float* weights, float* momentum, const int size, const Optimizer::Lion::Decay& decay) {
+        active().lionCatchUp(optimizer, weights, momentum, size, decay);
+    }
+
+    constexpr int CACHE_LINE = 64;
+
+    // Cache lines prefetched at the start of every row. They start the page walk and the first tiles of
+    // the row, the hardware prefetcher streams the rest. Whole rows cost more prefetch instructions than
+    // they save once the rows are in L3.
+    constexpr int PREFETCH_LINES = 4;
+
+    // Prefetches the rows of both perspectives of every feature into L2, ahead of the sample using them.
+    // The rows of a whole sample do not fit L1 and would evict the ones of the current sample.
+    template<int Write, typename T>
+    inline void prefetchRows(const T* rows, const Features& features) {
+        for (int i = 0; i < features.n; ++i) {
+            for (int half = 0; half < 2; ++half) {
+                const char* row = reinterpret_cast<const char*>(rows + std::size_t(features.features[i][half]) * HIDDEN_SIZE);
+                for (int line = 0; line < PREFETCH_LINES; ++line) {
+                    __builtin_prefetch(row + line * CACHE_LINE, Write, 2);
+                }
+            }
+        }
+    }
+
+    // The input weight rows the forward pass of a sample reads, in the precision it reads them
+    inline void prefetchWeights(const NN& nn, const Features& features) {
+        if (nn.isBF16()) {
+            prefetchRows<0>(nn.inputFeaturesBF16.data(), features);
+        } else if (nn.isInt8()) {
+            prefetchRows<0>(nn.inputFeaturesInt8.data(), features);
+        } else {
+            prefetchRows<0>(nn.inputFeatures.data(), features);
+        }
+    }
+
+    // The gradient rows the backward pass of a sample accumulates into
+    inline void prefetchGradients(const BatchGradients& gradients, const Features& features) {
+        prefetchRows<1>(gradients.inputFeatures.data(), features);
+    }
+
+    inline float fusedStep(const NN& nn, const Features& features, const NN::Color stm, const float expected, BatchGradients& gradients, float& loss) {
+        for (int i = 0; i < features.n; ++i) {
+            gradients.touchRow(features.features[i][stm]);
+            gradients.touchRow(features.features[i][!stm]);
+        }
+        return active().fusedStep(view(nn), view(features, stm), expected, view(gradients), loss);
+    }
+} // namespace Kernels
@@ -0,0 +1,6 @@
+#include "kernels_impl.h"
+
+// Built with the AVX2 instruction set, see the makefile
+namespace Kernels {
+    constexpr Table AVX2_TABLE = makeTable<AVX2>("AVX2");
+} // namespace Kernels
@@ -0,0 +1,6 @@
+#include "kernels_impl.h"
+
+// Built with the AVX-512 instruction set, see the makefile
+namespace Kernels {
+    constexpr Table AVX512_TABLE = makeTable<AVX512>("AVX-512");
+} // namespace Kernels
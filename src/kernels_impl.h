@@ -0,0 +1,539 @@
+#pragma once
+
+// Kernel bodies shared by every instruction set. Only included by the
+// kernels_*.cpp files, which instantiate makeTable for their vector type.
+// This code is compiled with wider instructions than the rest of the program,
+// so it lives in an unnamed namespace, one copy per translation unit, and
+// reaches the network only through the raw views of kernels.h. Anything it
+// calls from other headers must be static or a template over Arch: an inline
+// function with external linkage would be emitted here too, and the linker
+// may keep this copy for every caller.
+
+#include "kernels.h"
+#include "simd.h"
+
+namespace Kernels {
+namespace {
+    // Registers per perspective in a tile of the fused kernel
+    constexpr int TILE_REGS = 4;
+
+    // Input weights of any precision as floats. int8 codes are in units of 1 / Q1.
+    template<typename Arch>
+    static inline typename Arch::Reg loadWeights(const float* p) {
+        return Arch::load(p);
+    }
+
+    template<typename Arch>
+    static inline typename Arch::Reg loadWeights(const uint16_t* p) {
+        return Arch::load(p);
+    }
+
+    template<typename Arch>
+    static inline typename Arch::Reg loadWeights(const int8_t* p) {
+        return Arch::mul(Arch::loadInt8(p), Arch::set1(1.0f / Q1));
+    }
+
+    // Adds the hidden losses of one sample to the sparsity counts, both halves of HIDDEN_SIZE values
+    template<typename Arch>
+    static inline void countSparsity(Sparsity* sparsity, const int nonZeroValues, const int nonZeroBlocks) {
+        sparsity->values += HIDDEN_SIZE * 2;
+        sparsity->zeroValues += HIDDEN_SIZE * 2 - nonZeroValues;
+        sparsity->blocks += HIDDEN_SIZE * 2 / Arch::WIDTH;
+        sparsity->skippedBlocks += HIDDEN_SIZE * 2 / Arch::WIDTH - nonZeroBlocks;
+    }
+
+    // Accumulates, activates and reduces the output one tile at a time. The
+    // accumulator of a tile stays in registers while the feature rows are added.
+    // Weight is float for the master weights, uint16_t for their bf16 copy or int8_t for the int8 one.
+    template<typename Arch, typename Weight>
+    float forwardTiles(const Network& nn, const Weight* weights, const Sample& sample, float* accumulator, float* activated) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W    = Arch::WIDTH;
+        constexpr int TILE = TILE_REGS * W;
+
+        static_assert(HIDDEN_SIZE % TILE == 0);
+
+        const float* bias          = nn.inputBias;
+        const float* hiddenWeights = nn.hiddenFeatures;
+
+        const Weight* stmRows[32];
+        const Weight* nstmRows[32];
+
+        const int n = sample.n;
+        for (int i = 0; i < n; ++i) {
+            stmRows[i]  = weights + sample.features[2 * i + sample.stm] * HIDDEN_SIZE;
+            nstmRows[i] = weights + sample.features[2 * i + !sample.stm] * HIDDEN_SIZE;
+        }
+
+        Reg outputSum[TILE_REGS];
+        for (int r = 0; r < TILE_REGS; ++r) {
+            outputSum[r] = Arch::zero();
+        }
+
+        for (int t = 0; t < HIDDEN_SIZE; t += TILE) {
+            Reg us[TILE_REGS];
+            Reg them[TILE_REGS];
+
+            for (int r = 0; r < TILE_REGS; ++r) {
+                us[r]   = Arch::load(bias + t + r * W);
+                them[r] = us[r];
+            }
+
+            for (int i = 0; i < n; ++i) {
+                for (int r = 0; r < TILE_REGS; ++r) {
+                    us[r]   = Arch::add(us[r], loadWeights<Arch>(stmRows[i] + t + r * W));
+                    them[r] = Arch::add(them[r], loadWeights<Arch>(nstmRows[i] + t + r * W));
+                }
+            }
+
+            for (int r = 0; r < TILE_REGS; ++r) {
+                const int i = t + r * W;
+
+                Arch::store(accumulator + i, us[r]);
+                Arch::store(accumulator + HIDDEN_SIZE + i, them[r]);
+
+                const Reg activatedUs   = Arch::screlu(us[r]);
+                const Reg activatedThem = Arch::screlu(them[r]);
+
+                if (activated) {
+                    Arch::store(activated + i, activatedUs);
+                    Arch::store(activated + HIDDEN_SIZE + i, activatedThem);
+                }
+
+                outputSum[r] = Arch::fmadd(activatedUs, Arch::load(hiddenWeights + i), outputSum[r]);
+                outputSum[r] = Arch::fmadd(activatedThem, Arch::load(hiddenWeights + HIDDEN_SIZE + i), outputSum[r]);
+            }
+        }
+
+        for (int r = 1; r < TILE_REGS; ++r) {
+            outputSum[0] = Arch::add(outputSum[0], outputSum[r]);
+        }
+
+        return nn.hiddenBias + Arch::sum(outputSum[0]);
+    }
+
+    template<typename Arch>
+    float forwardTiles(const Network& nn, const Sample& sample, float* accumulator, float* activated) {
+        if (nn.inputFeaturesBF16) {
+            return forwardTiles<Arch>(nn, nn.inputFeaturesBF16, sample, accumulator, activated);
+        }
+        if (nn.inputFeaturesInt8) {
+            return forwardTiles<Arch>(nn, nn.inputFeaturesInt8, sample, accumulator, activated);
+        }
+        return forwardTiles<Arch>(nn, nn.inputFeatures, sample, accumulator, activated);
+    }
+
+    template<typename Arch>
+    float forward(const Network& nn, const Sample& sample, float* accumulator, float* activated) {
+        return forwardTiles<Arch>(nn, sample, accumulator, activated);
+    }
+
+    template<typename Arch>
+    float forwardOutput(const Network& nn, const float* accumulator, float* activated) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W = Arch::WIDTH;
+
+        const float* hiddenWeights = nn.hiddenFeatures;
+
+        Reg outputSum = Arch::zero();
+        for (int i = 0; i < HIDDEN_SIZE * 2; i += W) {
+            const Reg a = Arch::screlu(Arch::load(accumulator + i));
+            Arch::store(activated + i, a);
+            outputSum = Arch::fmadd(a, Arch::load(hiddenWeights + i), outputSum);
+        }
+
+        return nn.hiddenBias + Arch::sum(outputSum);
+    }
+
+    template<typename Arch, typename Weight>
+    void forwardBatchBlock(const Network& nn, const Weight* inputWeights, const Batch& batch, float* accumulators, const int block) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W    = Arch::WIDTH;
+        constexpr int REGS = BATCH_BLOCK / W;
+
+        static_assert(BATCH_BLOCK % W == 0);
+
+        const float* bias    = nn.inputBias + block;
+        const int*   offsets = batch.rowOffsets;
+        const int*   entries = batch.entries;
+
+        Reg biasRegs[REGS];
+        for (int r = 0; r < REGS; ++r) {
+            biasRegs[r] = Arch::load(bias + r * W);
+        }
+
+        for (std::size_t half = 0; half < batch.size * 2; ++half) {
+            float* accumulator = accumulators + half * HIDDEN_SIZE + block;
+            for (int r = 0; r < REGS; ++r) {
+                Arch::store(accumulator + r * W, biasRegs[r]);
+            }
+        }
+
+        for (int row = 0; row < INPUT_SIZE; ++row) {
+            if (offsets[row] == offsets[row + 1]) {
+                continue;
+            }
+
+            const Weight* weights = inputWeights + row * HIDDEN_SIZE + block;
+
+            Reg weightRegs[REGS];
+            for (int r = 0; r < REGS; ++r) {
+                weightRegs[r] = loadWeights<Arch>(weights + r * W);
+            }
+
+            for (int e = offsets[row]; e < offsets[row + 1]; ++e) {
+                float* accumulator = accumulators + std::size_t(entries[e]) * HIDDEN_SIZE + block;
+                for (int r = 0; r < REGS; ++r) {
+                    Arch::store(accumulator + r * W, Arch::add(Arch::load(accumulator + r * W), weightRegs[r]));
+                }
+            }
+        }
+    }
+
+    template<typename Arch>
+    void forwardBatchBlock(const Network& nn, const Batch& batch, float* accumulators, const int block) {
+        if (nn.inputFeaturesBF16) {
+            forwardBatchBlock<Arch>(nn, nn.inputFeaturesBF16, batch, accumulators, block);
+        } else if (nn.inputFeaturesInt8) {
+            forwardBatchBlock<Arch>(nn, nn.inputFeaturesInt8, batch, accumulators, block);
+        } else {
+            forwardBatchBlock<Arch>(nn, nn.inputFeatures, batch, accumulators, block);
+        }
+    }
+
+    // The hidden losses of a tile stay in registers while they are scattered into the gradient rows.
+    // Between the forward and the backward half the accumulator is parked in an L1 sized stack buffer.
+    template<typename Arch>
+    float fusedStep(const Network& nn, const Sample& sample, const float expected, const Gradients& gradients, float& loss) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W    = Arch::WIDTH;
+        constexpr int TILE = TILE_REGS * W;
+
+        alignas(64) float accumulator[HIDDEN_SIZE * 2];
+
+        const float output = forwardTiles<Arch>(nn, sample, accumulator, nullptr);
+
+        loss                    = errorFunction(output, expected);
+        const float outGradient = errorGradient(output, expected) * sigmoidPrime(output);
+
+        float* gradientRows = gradients.inputFeatures;
+        float* stmGradients[32];
+        float* nstmGradients[32];
+
+        const int n = sample.n;
+        for (int i = 0; i < n; ++i) {
+            stmGradients[i]  = gradientRows + sample.features[2 * i + sample.stm] * HIDDEN_SIZE;
+            nstmGradients[i] = gradientRows + sample.features[2 * i + !sample.stm] * HIDDEN_SIZE;
+        }
+
+        const float* hiddenWeights = nn.hiddenFeatures;
+        float*       hiddenGrads   = gradients.hiddenFeatures;
+        float*       biasGrads     = gradients.inputBias;
+
+        gradients.hiddenBias[0] += outGradient;
+
+        const Reg gradient = Arch::set1(outGradient);
+
+        int nonZeroValues = 0;
+        int nonZeroBlocks = 0;
+
+        for (int t = 0; t < HIDDEN_SIZE; t += TILE) {
+            Reg us[TILE_REGS];
+            Reg them[TILE_REGS];
+
+            // Bit r is set if register r of the half has a nonzero loss
+            unsigned usBlocks   = 0;
+            unsigned themBlocks = 0;
+
+            for (int r = 0; r < TILE_REGS; ++r) {
+                const int i = t + r * W;
+
+                const Reg accUs   = Arch::load(accumulator + i);
+                const Reg accThem = Arch::load(accumulator + HIDDEN_SIZE + i);
+
+                Arch::store(hiddenGrads + i, Arch::fmadd(gradient, Arch::screlu(accUs), Arch::load(hiddenGrads + i)));
+                Arch::store(hiddenGrads + HIDDEN_SIZE + i, Arch::fmadd(gradient, Arch::screlu(accThem), Arch::load(hiddenGrads + HIDDEN_SIZE + i)));
+
+                us[r]   = Arch::mul(Arch::mul(gradient, Arch::load(hiddenWeights + i)), Arch::screluPrime(accUs));
+                them[r] = Arch::mul(Arch::mul(gradient, Arch::load(hiddenWeights + HIDDEN_SIZE + i)), Arch::screluPrime(accThem));
+
+                const int usLanes   = Arch::nonZero(us[r]);
+                const int themLanes = Arch::nonZero(them[r]);
+
+                usBlocks |= unsigned(usLanes != 0) << r;
+                themBlocks |= unsigned(themLanes != 0) << r;
+                nonZeroValues += __builtin_popcount(unsigned(usLanes)) + __builtin_popcount(unsigned(themLanes));
+
+                if (usLanes | themLanes) {
+                    Arch::store(biasGrads + i, Arch::add(Arch::load(biasGrads + i), Arch::add(us[r], them[r])));
+                }
+            }
+
+            nonZeroBlocks += __builtin_popcount(usBlocks) + __builtin_popcount(themBlocks);
+
+            // Only the registers with a nonzero loss are added into the rows
+            if (usBlocks) {
+                for (int j = 0; j < n; ++j) {
+                    for (int r = 0; r < TILE_REGS; ++r) {
+                        if (usBlocks >> r & 1) {
+                            float* row = stmGradients[j] + t + r * W;
+                            Arch::store(row, Arch::add(Arch::load(row), us[r]));
+                        }
+                    }
+                }
+            }
+            if (themBlocks) {
+                for (int j = 0; j < n; ++j) {
+                    for (int r = 0; r < TILE_REGS; ++r) {
+                        if (themBlocks >> r & 1) {
+                            float* row = nstmGradients[j] + t + r * W;
+                            Arch::store(row, Arch::add(Arch::load(row), them[r]));
+                        }
+                    }
+                }
+            }
+        }
+
+        countSparsity<Arch>(gradients.sparsity, nonZeroValues, nonZeroBlocks);
+
+        return output;
+    }
+
+    template<typename Arch>
+    void backward(const Network& nn, const float* accumulator, const float* activated, const float outGradient, const Gradients& gradients, float* hiddenLosses) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W = Arch::WIDTH;
+
+        const float* hiddenWeights = nn.hiddenFeatures;
+        float*       hiddenGrads   = gradients.hiddenFeatures;
+        float*       biasGrads     = gradients.inputBias;
+
+        gradients.hiddenBias[0] += outGradient;
+
+        const Reg gradient = Arch::set1(outGradient);
+
+        int nonZeroValues = 0;
+        int nonZeroBlocks = 0;
+
+        // Both halves in one pass, so hiddenLosses can overwrite the accumulator
+        for (int i = 0; i < HIDDEN_SIZE; i += W) {
+            const Reg accUs   = Arch::load(accumulator + i);
+            const Reg accThem = Arch::load(accumulator + HIDDEN_SIZE + i);
+
+            Arch::store(hiddenGrads + i, Arch::fmadd(gradient, Arch::load(activated + i), Arch::load(hiddenGrads + i)));
+            Arch::store(hiddenGrads + HIDDEN_SIZE + i, Arch::fmadd(gradient, Arch::load(activated + HIDDEN_SIZE + i), Arch::load(hiddenGrads + HIDDEN_SIZE + i)));
+
+            const Reg us   = Arch::mul(Arch::mul(gradient, Arch::load(hiddenWeights + i)), Arch::screluPrime(accUs));
+            const Reg them = Arch::mul(Arch::mul(gradient, Arch::load(hiddenWeights + HIDDEN_SIZE + i)), Arch::screluPrime(accThem));
+
+            Arch::store(hiddenLosses + i, us);
+            Arch::store(hiddenLosses + HIDDEN_SIZE + i, them);
+
+            const int usLanes   = Arch::nonZero(us);
+            const int themLanes = Arch::nonZero(them);
+
+            nonZeroValues += __builtin_popcount(unsigned(usLanes)) + __builtin_popcount(unsigned(themLanes));
+            nonZeroBlocks += (usLanes != 0) + (themLanes != 0);
+
+            if (usLanes | themLanes) {
+                Arch::store(biasGrads + i, Arch::add(Arch::load(biasGrads + i), Arch::add(us, them)));
+            }
+        }
+
+        countSparsity<Arch>(gradients.sparsity, nonZeroValues, nonZeroBlocks);
+    }
+
+    // Registers of zero losses leave the row untouched
+    template<typename Arch>
+    void addRow(float* row, const float* values) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W = Arch::WIDTH;
+
+        for (int i = 0; i < HIDDEN_SIZE; i += W) {
+            const Reg value = Arch::load(values + i);
+            if (Arch::nonZero(value)) {
+                Arch::store(row + i, Arch::add(Arch::load(row + i), value));
+            }
+        }
+    }
+
+    template<typename Arch, typename Optimizer>
+    void optimizeRow(const Optimizer& optimizer, float* weights, float* m, float* v, const float* const* rows, const int count, const int size, const float learningRate) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W = Arch::WIDTH;
+
+        for (int i = 0; i < size; i += W) {
+            Reg gradient = Arch::load(rows[0] + i);
+            for (int k = 1; k < count; ++k) {
+                gradient = Arch::add(gradient, Arch::load(rows[k] + i));
+            }
+
+            Reg weight = Arch::load(weights + i);
+            Reg first  = Arch::load(m + i);
+            Reg second = Arch::load(v + i);
+
+            optimizer.template update<Arch>(weight, first, second, gradient, learningRate);
+
+            Arch::store(weights + i, weight);
+            Arch::store(m + i, first);
+            Arch::store(v + i, second);
+        }
+    }
+
+    template<typename Arch, typename Optimizer>
+    void optimizeMomentumRow(const Optimizer& optimizer, float* weights, float* momentum, const float* const* rows, const int count, const int size, const float learningRate) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W = Arch::WIDTH;
+
+        for (int i = 0; i < size; i += W) {
+            Reg gradient = Arch::load(rows[0] + i);
+            for (int k = 1; k < count; ++k) {
+                gradient = Arch::add(gradient, Arch::load(rows[k] + i));
+            }
+
+            Reg weight = Arch::load(weights + i);
+            Reg m      = Arch::load(momentum + i);
+
+            optimizer.template update<Arch>(weight, m, gradient, learningRate);
+
+            Arch::store(weights + i, weight);
+            Arch::store(momentum + i, m);
+        }
+    }
+
+    // The moments of a block are decoded into registers, updated, and encoded again against the new block maxima
+    template<typename Arch, typename Optimizer>
+    void optimizeQuantizedRow(const Optimizer& optimizer, float* weights, MomentBlock* blocks, const float* const* rows, const int count, const int size, const float learningRate) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W    = Arch::WIDTH;
+        constexpr int REGS = MOMENT_BLOCK / W;
+
+        static_assert(MOMENT_BLOCK % W == 0);
+
+        for (int b = 0; b < size / MOMENT_BLOCK; ++b) {
+            MomentBlock& block  = blocks[b];
+            const int    offset = b * MOMENT_BLOCK;
+
+            const Reg mScale = Arch::set1(block.mScale);
+            const Reg vScale = Arch::set1(block.vScale);
+
+            Reg m[REGS];
+            Reg roots[REGS];
+            Reg maxM    = Arch::zero();
+            Reg maxRoot = Arch::zero();
+
+            for (int r = 0; r < REGS; ++r) {
+                const int i = offset + r * W;
+
+                Reg gradient = Arch::load(rows[0] + i);
+                for (int k = 1; k < count; ++k) {
+                    gradient = Arch::add(gradient, Arch::load(rows[k] + i));
+                }
+
+                const Reg mCode = Arch::loadInt8(block.m + r * W);
+                const Reg vCode = Arch::loadUint8(block.v + r * W);
+                const Reg root  = Arch::mul(vScale, Arch::mul(vCode, vCode));
+
+                Reg weight = Arch::load(weights + i);
+                Reg v      = Arch::mul(root, root);
+                m[r]       = Arch::mul(mScale, Arch::mul(mCode, Arch::abs(mCode)));
+
+                optimizer.template update<Arch>(weight, m[r], v, gradient, learningRate);
+
+                Arch::store(weights + i, weight);
+
+                roots[r] = Arch::sqrt(v);
+                maxM     = Arch::max(maxM, Arch::abs(m[r]));
+                maxRoot  = Arch::max(maxRoot, roots[r]);
+            }
+
+            const float blockMaxM    = Arch::maxOf(maxM);
+            const float blockMaxRoot = Arch::maxOf(maxRoot);
+
+            block.mScale = blockMaxM / (127.0f * 127.0f);
+            block.vScale = blockMaxRoot / (255.0f * 255.0f);
+
+            const Reg mInverse = Arch::set1(blockMaxM > 0 ? 1 / block.mScale : 0);
+            const Reg vInverse = Arch::set1(blockMaxRoot > 0 ? 1 / block.vScale : 0);
+
+            for (int r = 0; r < REGS; ++r) {
+                const Reg mCode = Arch::min(Arch::sqrt(Arch::mul(Arch::abs(m[r]), mInverse)), Arch::set1(127.0f));
+                const Reg vCode = Arch::min(Arch::ceil(Arch::sqrt(Arch::mul(roots[r], vInverse))), Arch::set1(255.0f));
+
+                Arch::storeInt8(block.m + r * W, Arch::withSign(mCode, m[r]));
+                Arch::storeUint8(block.v + r * W, vCode);
+            }
+        }
+    }
+
+    // The decay is computed once per row by the caller, the kernel only applies it
+    template<typename Arch, typename Optimizer>
+    void catchUpRow(const Optimizer& optimizer, float* weights, float* m, float* v, const int size, const typename Optimizer::Decay& decay) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W = Arch::WIDTH;
+
+        for (int i = 0; i < size; i += W) {
+            Reg weight = Arch::load(weights + i);
+            Reg first  = Arch::load(m + i);
+            Reg second = Arch::load(v + i);
+
+            optimizer.template catchUp<Arch>(weight, first, second, decay);
+
+            Arch::store(weights + i, weight);
+            Arch::store(m + i, first);
+            Arch::store(v + i, second);
+        }
+    }
+
+    template<typename Arch, typename Optimizer>
+    void catchUpMomentumRow(const Optimizer& optimizer, float* weights, float* momentum, const int size, const typename Optimizer::Decay& decay) {
+        using Reg = typename Arch::Reg;
+
+        constexpr int W = Arch::WIDTH;
+
+        for (int i = 0; i < size; i += W) {
+            Reg weight = Arch::load(weights + i);
+            Reg m      = Arch::load(momentum + i);
+
+            optimizer.template catchUp<Arch>(weight, m, decay);
+
+            Arch::store(weights + i, weight);
+            Arch::store(momentum + i, m);
+        }
+    }
+
+    template<typename Arch>
+    constexpr Table makeTable(const char* name) {
+        return Table{
+            name,
+            &forward<Arch>,
+            &forwardOutput<Arch>,
+            &forwardBatchBlock<Arch>,
+            &fusedStep<Arch>,
+            &backward<Arch>,
+            &addRow<Arch>,
+            &optimizeRow<Arch, Optimizer::Adam>,
+            &optimizeRow<Arch, Optimizer::AdamW>,
+            &optimizeRow<Arch, Optimizer::Adamax>,
+            &optimizeQuantizedRow<Arch, Optimizer::Adam>,
+            &optimizeQuantizedRow<Arch, Optimizer::AdamW>,
+            &optimizeQuantizedRow<Arch, Optimizer::Adamax>,
+            &optimizeMomentumRow<Arch, Optimizer::Lion>,
+            &catchUpRow<Arch, Optimizer::Adam>,
+            &catchUpRow<Arch, Optimizer::AdamW>,
+            &catchUpRow<Arch, Optimizer::Adamax>,
+            &catchUpMomentumRow<Arch, Optimizer::Lion>,
+        };
+    }
+} // namespace
+} // namespace Kernels
@@ -0,0 +1,6 @@
+#include "kernels_impl.h"
+
+// Built with the SSE4.1 instruction set, see the makefile
+namespace Kernels {
+    constexpr Table SSE41_TABLE = makeTable<SSE41>("SSE4.1");
+} // namespace Kernels
@@ -1,11 +1,22 @@
 #include "argparse.h"
+#include "attacks.h"
+#include "bench.h"
+#include "kernels.h"
+#include "memory.h"
 #include "quantize.h"
+#include "tasks.h"
 #include "trainer.h"
 
-#include <omp.h>
 #include <sstream>
 
 int main(int argc, char* argv[]) {
+    // Benchmarks run on synthetic data and take no training arguments, a binpack file adds the decode and update ones
+    if (argc >= 2 && std::string(argv[1]) == "bench") {
+        Attacks::select(Attacks::fastest());
+        Bench::run(argc >= 3 ? argv[2] : "");
+        return 0;
+    }
+
     ArgumentParser parser;
     parser.addArgument("--data", "Path to training data.");
     parser.addArgument("--val-data", "Path to validation data.");
@@ -13,11 +24,23 @@ int main(int argc, char* argv[]) {
     parser.addArgument("--start-lambda", "Starting lambda value. (Default: 1)", true);
     parser.addArgument("--end-lambda", "Ending lambda value. (Default: 0.7)", true);
     parser.addArgument("--skip", "Skip N fens on average (Default 16)", true);
+    parser.addArgument("--chunk-order", "Order the binpack chunks are read in on every pass, sequential or random. (Default: sequential)", true);
     parser.addArgument("--id", "Unique network identifier.", true);
     parser.addArgument("--lr", "Initial learning rate. (Default: 0.001)", true);
     parser.addArgument("--checkpoint", "Path to checkpoint.", true);
     parser.addArgument("--save", "Checkpoint save directory.", true);
     parser.addArgument("--batchsize", "Batch size. (Default: 16384)", true);
+    parser.addArgument("--accumulate", "Micro-batches of --batchsize summed per optimizer step. (Default: 1)", true);
+    parser.addArgument("--prefetch", "Samples ahead whose rows the batch loop prefetches, 0 disables it. (Default: 1)", true);
+    parser.addArgument("--update", "Update mode, sync, pipelined or hogwild. (Default: sync)", true);
+    parser.addArgument("--forward", "Forward pass mode, sample or batched. (Default: sample)", true);
+    parser.addArgument("--backward", "Backward pass mode, thread or owner. (Default: thread)", true);
+    parser.addArgument("--precision", "Input weight precision of the forward pass, fp32, bf16 or int8 for quantization-aware training. The fp32 master weights are kept, so bf16 and int8 add memory instead of saving it. (Default: fp32)", true);
+    parser.addArgument("--optimizer", "Optimizer, adamw, adam, adamax or lion. (Default: adamw)", true);
+    parser.addArgument("--moments", "Optimizer moment precision of the input features, fp32 or int8. (Default: fp32)", true);
+    parser.addArgument("--simd", "Kernels to use, scalar, SSE4.1, AVX2 or AVX-512. (Default: widest supported)", true);
+    parser.addArgument("--attacks", "Sliding attacks of the data decoder, magic or pext. (Default: pext where PEXT is fast)", true);
+    parser.addArgument("--threads", "Worker threads, spread over the NUMA nodes. (Default: all available CPUs)", true);
     parser.setProgramName(argv[0]);
 
     // Print help and exit if no arguments or --help flag provided
@@ -42,9 +65,103 @@ int main(int argc, char* argv[]) {
     float       startLambda    = parser.getArgumentValue("--start-lambda").empty() ? 1.0f : std::stof(parser.getArgumentValue("--start-lambda"));
     float       endLambda      = parser.getArgumentValue("--end-lambda").empty() ? 0.7f : std::stof(parser.getArgumentValue("--end-lambda"));
     int         skip           = parser.getArgumentValue("--skip").empty() ? 16 : std::stoi(parser.getArgumentValue("--skip"));
+    std::string chunkOrder     = parser.getArgumentValue("--chunk-order").empty() ? "sequential" : parser.getArgumentValue("--chunk-order");
     std::size_t         batchSize      = parser.getArgumentValue("--batchsize").empty() ? 16384 : std::stoull(parser.getArgumentValue("--batchsize"));
+    int         accumulate     = parser.getArgumentValue("--accumulate").empty() ? 1 : std::stoi(parser.getArgumentValue("--accumulate"));
+    int         prefetch       = parser.getArgumentValue("--prefetch").empty() ? 1 : std::stoi(parser.getArgumentValue("--prefetch"));
+    std::string update         = parser.getArgumentValue("--update").empty() ? "sync" : parser.getArgumentValue("--update");
+    std::string forward        = parser.getArgumentValue("--forward").empty() ? "sample" : parser.getArgumentValue("--forward");
+    std::string backward       = parser.getArgumentValue("--backward").empty() ? "thread" : parser.getArgumentValue("--backward");
+    std::string precision      = parser.getArgumentValue("--precision").empty() ? "fp32" : parser.getArgumentValue("--precision");
+    std::string optimizerName  = parser.getArgumentValue("--optimizer").empty() ? "adamw" : parser.getArgumentValue("--optimizer");
+    std::string moments        = parser.getArgumentValue("--moments").empty() ? "fp32" : parser.getArgumentValue("--moments");
+    std::string simd           = parser.getArgumentValue("--simd");
+    std::string attacks        = parser.getArgumentValue("--attacks").empty() ? Attacks::fastest() : parser.getArgumentValue("--attacks");
+    int         threads        = parser.getArgumentValue("--threads").empty() ? 0 : std::stoi(parser.getArgumentValue("--threads"));
+
+    if (!simd.empty() && !Kernels::select(simd)) {
+        std::cerr << "Error: " << simd << " kernels are not supported on this CPU.\n";
+        return 1;
+    }
+
+    if (!Attacks::select(attacks)) {
+        std::cerr << "Error: " << attacks << " attacks are not supported on this CPU.\n";
+        return 1;
+    }
+
+    Optimizer::Any optimizer;
+    if (optimizerName == "adam") {
+        optimizer = Optimizer::Adam();
+    } else if (optimizerName == "adamax") {
+        optimizer = Optimizer::Adamax();
+    } else if (optimizerName == "lion") {
+        optimizer = Optimizer::Lion();
+    } else if (optimizerName != "adamw") {
+        std::cerr << "Error: Unknown optimizer " << optimizerName << ".\n";
+        return 1;
+    }
+
+    if (update != "sync" && update != "pipelined" && update != "hogwild") {
+        std::cerr << "Error: Unknown update mode " << update << ".\n";
+        return 1;
+    }
+
+    if (forward != "sample" && forward != "batched") {
+        std::cerr << "Error: Unknown forward mode " << forward << ".\n";
+        return 1;
+    }
+
+    if (backward != "thread" && backward != "owner") {
+        std::cerr << "Error: Unknown backward mode " << backward << ".\n";
+        return 1;
+    }
+
+    if (chunkOrder != "sequential" && chunkOrder != "random") {
+        std::cerr << "Error: Unknown chunk order " << chunkOrder << ".\n";
+        return 1;
+    }
+
+    if (precision != "fp32" && precision != "bf16" && precision != "int8") {
+        std::cerr << "Error: Unknown weight precision " << precision << ".\n";
+        return 1;
+    }
+
+    if (moments != "fp32" && moments != "int8") {
+        std::cerr << "Error: Unknown moment precision " << moments << ".\n";
+        return 1;
+    }
+
+    const bool int8Moments = moments == "int8";
+
+    if (int8Moments && std::holds_alternative<Optimizer::Lion>(optimizer)) {
+        std::cerr << "Error: Lion keeps a single fp32 momentum, int8 moments are not supported.\n";
+        return 1;
+    }
+
+    // Hogwild samples update the weights one at a time, without batched forward passes, gradient copies or accumulation
+    if (update == "hogwild") {
+        if (forward != "sample" || backward != "thread" || accumulate != 1) {
+            std::cerr << "Error: hogwild updates only support --forward sample, --backward thread and --accumulate 1.\n";
+            return 1;
+        }
+        if (int8Moments) {
+            std::cerr << "Error: hogwild updates race on the shared scales of int8 moments, use fp32 moments.\n";
+            return 1;
+        }
+    }
+
+    if (threads < 0 || threads > MAX_THREADS) {
+        std::cerr << "Error: --threads must be between 0 (all CPUs) and " << MAX_THREADS << ".\n";
+        return 1;
+    }
+
+    // The pool is sized before the trainer, which places its buffers on the workers' nodes
+    Tasks::setThreads(threads);
 
     Trainer* trainer = new Trainer{datasetPath, batchSize, valDatasetPath};
+    trainer->setOptimizer(optimizer);
+    trainer->setWeightPrecision(precision == "bf16" ? WeightPrecision::BF16 : precision == "int8" ? WeightPrecision::Int8 : WeightPrecision::FP32);
+    trainer->setMomentPrecision(int8Moments ? MomentPrecision::Int8 : MomentPrecision::FP32);
 
     // Try to load checkpoint if provided.
     // if this fails, the function will exit the program and show an error.
@@ -61,6 +178,12 @@ int main(int argc, char* argv[]) {
     trainer->setLearningRate(lr);
     trainer->setLambda(startLambda, endLambda);
     trainer->setRandomFenSkipping(skip);
+    trainer->setRandomChunkOrder(chunkOrder == "random");
+    trainer->setAccumulationSteps(accumulate);
+    trainer->setPrefetchDistance(prefetch);
+    trainer->setUpdateMode(update == "hogwild" ? UpdateMode::Hogwild : update == "pipelined" ? UpdateMode::Pipelined : UpdateMode::Synchronous);
+    trainer->setForwardMode(forward == "batched" ? ForwardMode::Batched : ForwardMode::PerSample);
+    trainer->setBackwardMode(backward == "owner" ? BackwardMode::RowOwner : BackwardMode::PerThread);
 
     // Print Configurations
     std::cout << "Dataset Path: " << datasetPath << "\n";
@@ -72,12 +195,24 @@ int main(int argc, char* argv[]) {
     std::cout << "Optimizer: " << trainer->optimizer << "\n";
     std::cout << "LR Scheduler: " << trainer->lrScheduler << "\n";
     std::cout << "Fen Skipping: " << skip << "\n";
+    std::cout << "Chunk Order: " << chunkOrder << "\n";
     std::cout << "Start Lambda: " << trainer->getStartLambda() << "\n";
     std::cout << "End Lambda: " << trainer->getEndLambda() << "\n";
     std::cout << "Epochs: " << trainer->getMaxEpochs() << "\n";
-    std::cout << "Batchsize: " << trainer->getBatchSize() << "\n\n";
-    std::cout << "Number of Available Threads: " << omp_get_max_threads() << "\n";
-    std::cout << "Allocated threads: " << THREADS << "\n";
+    std::cout << "Batchsize: " << trainer->getBatchSize() << "\n";
+    std::cout << "Accumulation Steps: " << trainer->getAccumulationSteps() << " (effective batchsize " << trainer->getBatchSize() * trainer->getAccumulationSteps() << ")\n";
+    std::cout << "Prefetch Distance: " << trainer->getPrefetchDistance() << "\n";
+    std::cout << "Update Mode: " << update << "\n";
+    std::cout << "Forward Mode: " << forward << "\n";
+    std::cout << "Backward Mode: " << backward << "\n";
+    std::cout << "Weight Precision: " << precision << "\n";
+    std::cout << "Optimizer Moments: " << moments << "\n\n";
+    std::cout << "SIMD Kernels: " << Kernels::name() << "\n";
+    std::cout << "Attacks: " << Attacks::name() << "\n";
+    std::cout << "Number of Available Threads: " << Tasks::availableCpus() << "\n";
+    std::cout << "NUMA Nodes: " << Tasks::numaNodes() << "\n";
+    std::cout << "Allocated threads: " << Tasks::threads() << "\n";
+    std::cout << "Huge Pages: " << Memory::hugePageBytes() / (1 << 20) << " of " << Memory::allocatedBytes() / (1 << 20) << " MB (transparent: " << Memory::transparentHugePages() << ")\n";
     std::cout << std::endl;
 
     trainer->train();
@@ -0,0 +1,202 @@
+#include "memory.h"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <linux/mman.h>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <sys/mman.h>
+
+namespace Memory {
+
+    constexpr std::size_t GIGANTIC_PAGE = std::size_t(1) << 30;
+
+    struct Allocation {
+        std::size_t bytes;
+        Backing     backing;
+    };
+
+    // Allocations of the arena by address, so release() and the reports need no size
+    static std::mutex                           registryMutex;
+    static std::map<std::uintptr_t, Allocation> registry;
+
+    static std::size_t roundUp(const std::size_t bytes, const std::size_t page) {
+        return (bytes + page - 1) / page * page;
+    }
+
+    static void* map(const std::size_t bytes, const int flags) {
+        void* data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+        return data == MAP_FAILED ? nullptr : data;
+    }
+
+    // Normal pages aligned to HUGE_PAGE, the excess of an oversized mapping is unmapped again
+    static void* mapAligned(const std::size_t bytes) {
+        char* data = static_cast<char*>(map(bytes + HUGE_PAGE, 0));
+        if (data == nullptr) {
+            return nullptr;
+        }
+
+        char* aligned = reinterpret_cast<char*>(roundUp(reinterpret_cast<std::uintptr_t>(data), HUGE_PAGE));
+        if (aligned != data) {
+            munmap(data, aligned - data);
+        }
+        munmap(aligned + bytes, data + HUGE_PAGE - aligned);
+        return aligned;
+    }
+
+    void* allocate(const std::size_t size, const bool hugePages) {
+        if (size == 0) {
+            return nullptr;
+        }
+
+        Allocation allocation{roundUp(size, HUGE_PAGE), Backing::Pages};
+        void*      data = nullptr;
+
+        if (hugePages && size >= GIGANTIC_PAGE) {
+            data = map(roundUp(size, GIGANTIC_PAGE), MAP_HUGETLB | MAP_HUGE_1GB);
+            if (data != nullptr) {
+                allocation = {roundUp(size, GIGANTIC_PAGE), Backing::GiganticPages};
+            }
+        }
+
+        if (hugePages && data == nullptr) {
+            data = map(allocation.bytes, MAP_HUGETLB | MAP_HUGE_2MB);
+            if (data != nullptr) {
+                allocation.backing = Backing::HugePages;
+            }
+        }
+
+        if (data == nullptr) {
+            data = mapAligned(allocation.bytes);
+            if (data == nullptr) {
+                throw std::bad_alloc();
+            }
+
+            // Without reserved pages the kernel may still back the mapping with transparent huge pages.
+            // Comparison buffers opt out, in case the host enables them for every mapping.
+            if (!hugePages) {
+                madvise(data, allocation.bytes, MADV_NOHUGEPAGE);
+            } else if (madvise(data, allocation.bytes, MADV_HUGEPAGE) == 0 && transparentHugePages() != "never") {
+                allocation.backing = Backing::TransparentHugePages;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry[reinterpret_cast<std::uintptr_t>(data)] = allocation;
+        return data;
+    }
+
+    void release(void* data) {
+        if (data == nullptr) {
+            return;
+        }
+
+        std::size_t bytes;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            const auto                  it = registry.find(reinterpret_cast<std::uintptr_t>(data));
+            bytes                          = it->second.bytes;
+            registry.erase(it);
+        }
+        munmap(data, bytes);
+    }
+
+    // The allocation holding data
+    static std::pair<std::uintptr_t, Allocation> find(const void* data) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+
+        auto it = registry.upper_bound(reinterpret_cast<std::uintptr_t>(data));
+        if (it == registry.begin()) {
+            return {0, {0, Backing::Pages}};
+        }
+        --it;
+        return *it;
+    }
+
+    Backing backing(const void* data) {
+        return find(data).second.backing;
+    }
+
+    // Sums the huge page fields of the mappings in /proc/self/smaps overlapping the allocation. The kernel
+    // merges neighbouring mappings of the same kind, so a neighbour of the allocation may be counted too.
+    std::size_t hugeBytes(const void* data) {
+        const auto [start, allocation] = find(data);
+        const std::uintptr_t end       = start + allocation.bytes;
+
+        std::ifstream smaps("/proc/self/smaps");
+        std::string   line;
+        std::size_t   kilobytes = 0;
+        bool          inside    = false;
+
+        while (std::getline(smaps, line)) {
+            std::uintptr_t     first, last;
+            char               dash;
+            std::istringstream header(line);
+            if (header >> std::hex >> first >> dash >> last && dash == '-') {
+                inside = first < end && start < last;
+                continue;
+            }
+
+            if (!inside) {
+                continue;
+            }
+
+            std::istringstream field(line);
+            std::string        name;
+            std::size_t        value;
+            if (field >> name >> value && (name == "AnonHugePages:" || name == "Private_Hugetlb:" || name == "Shared_Hugetlb:")) {
+                kilobytes += value;
+            }
+        }
+        return std::min(kilobytes * 1024, allocation.bytes);
+    }
+
+    std::size_t allocatedBytes() {
+        std::lock_guard<std::mutex> lock(registryMutex);
+
+        std::size_t bytes = 0;
+        for (const auto& [start, allocation] : registry) {
+            bytes += allocation.bytes;
+        }
+        return bytes;
+    }
+
+    std::size_t hugePageBytes() {
+        std::lock_guard<std::mutex> lock(registryMutex);
+
+        std::size_t bytes = 0;
+        for (const auto& [start, allocation] : registry) {
+            if (allocation.backing != Backing::Pages) {
+                bytes += allocation.bytes;
+            }
+        }
+        return bytes;
+    }
+
+    // The active policy is the one in brackets, as in "always [madvise] never"
+    std::string transparentHugePages() {
+        std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+        std::string   policy;
+        while (file >> policy) {
+            if (policy.front() == '[') {
+                return policy.substr(1, policy.size() - 2);
+            }
+        }
+        return "never";
+    }
+
+    const char* name(const Backing backing) {
+        switch (backing) {
+        case Backing::TransparentHugePages:
+            return "transparent 2 MB pages";
+        case Backing::HugePages:
+            return "2 MB pages";
+        case Backing::GiganticPages:
+            return "1 GB pages";
+        default:
+            return "4 KB pages";
+        }
+    }
+
+} // namespace Memory
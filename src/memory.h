@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Storage of the large trainer buffers: the network, its optimizer state, the per thread gradients
+// and the loaded chunks of the data sets. The forward and backward passes access input rows in random
+// order, and on 4 KB pages nearly every row needs a new TLB entry. Buffers of the arena are aligned to
+// 2 MB and backed by huge pages when the host provides them:
+//   1. reserved 1 GB pages (MAP_HUGETLB) for buffers of at least 1 GB,
+//   2. reserved 2 MB pages (MAP_HUGETLB),
+//   3. transparent huge pages requested with madvise(MADV_HUGEPAGE),
+// falling back to normal pages when none of them is available. The memory is zero and untouched
+// when returned, so the first touch of the workers still places it on their NUMA node.
+namespace Memory {
+
+    constexpr std::size_t HUGE_PAGE = std::size_t(2) << 20;
+
+    // How an allocation of the arena is backed
+    enum class Backing {
+        Pages,
+        TransparentHugePages,
+        HugePages,
+        GiganticPages,
+    };
+
+    // Returns zeroed memory of at least bytes aligned to HUGE_PAGE. With hugePages = false the
+    // buffer is kept on normal pages, for comparisons only.
+    void* allocate(std::size_t bytes, bool hugePages = true);
+    void  release(void* data);
+
+    // Backing requested for an allocation of the arena
+    Backing backing(const void* data);
+
+    // Bytes of the allocation holding data the kernel actually backs with huge pages, transparent
+    // huge pages are only assigned once touched and may be split up later
+    std::size_t hugeBytes(const void* data);
+
+    // Total bytes allocated from the arena and the part of them on reserved or transparent huge pages
+    std::size_t allocatedBytes();
+    std::size_t hugePageBytes();
+
+    // The transparent huge page policy of the host, "always", "madvise" or "never"
+    std::string transparentHugePages();
+
+    const char* name(Backing backing);
+
+    // Base of the large objects, new places them in the arena
+    struct Arena {
+        static void* operator new(const std::size_t bytes) {
+            return allocate(bytes);
+        }
+
+        static void operator delete(void* data) {
+            release(data);
+        }
+    };
+
+    // Allocator of containers in the arena. Elements are constructed as usual, so a Vector touches its
+    // pages on the allocating thread. Buffers the workers first touch are Buffers instead.
+    template<typename T>
+    struct Allocator {
+        using value_type = T;
+
+        Allocator() = default;
+
+        template<typename U>
+        Allocator(const Allocator<U>&) {}
+
+        T* allocate(const std::size_t count) {
+            return static_cast<T*>(Memory::allocate(count * sizeof(T)));
+        }
+
+        void deallocate(T* data, std::size_t) {
+            release(data);
+        }
+
+        template<typename U>
+        bool operator==(const Allocator<U>&) const {
+            return true;
+        }
+    };
+
+    template<typename T>
+    using Vector = std::vector<T, Allocator<T>>;
+
+    // Fixed size array of the arena that never touches its elements: they start as the zero memory of
+    // the arena, so the workers can first touch their own slices. There is no resize, a buffer of
+    // another size is a new buffer.
+    template<typename T>
+    class Buffer {
+        static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>, "the elements are never constructed");
+
+    public:
+        Buffer() = default;
+
+        explicit Buffer(const std::size_t size) : m_data{static_cast<T*>(allocate(size * sizeof(T)))}, m_size{size} {}
+
+        ~Buffer() {
+            release(m_data);
+        }
+
+        Buffer(const Buffer&)            = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        Buffer(Buffer&& other) noexcept : m_data{std::exchange(other.m_data, nullptr)}, m_size{std::exchange(other.m_size, 0)} {}
+
+        Buffer& operator=(Buffer&& other) noexcept {
+            std::swap(m_data, other.m_data);
+            std::swap(m_size, other.m_size);
+            return *this;
+        }
+
+        T* data() {
+            return m_data;
+        }
+
+        const T* data() const {
+            return m_data;
+        }
+
+        std::size_t size() const {
+            return m_size;
+        }
+
+        bool empty() const {
+            return m_size == 0;
+        }
+
+        T& operator[](const std::size_t index) {
+            return m_data[index];
+        }
+
+        const T& operator[](const std::size_t index) const {
+            return m_data[index];
+        }
+
+    private:
+        T*          m_data = nullptr;
+        std::size_t m_size = 0;
+    };
+
+} // namespace Memory
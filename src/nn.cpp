@@ -2,10 +2,11 @@
 #include "types.h"
 #include "quantize.h"
 #include "dataloader.h"
+#include "kernels.h"
+#include "tasks.h"
 #include <memory>
 #include <fstream>
 #include <iostream>
-#include <omp.h>
 
 float errorGradient(float output, float eval, float wdl) {
     float expected = EVAL_CP_RATIO * sigmoid(eval) + (1 - EVAL_CP_RATIO) * wdl;
@@ -46,66 +47,98 @@ void NN::testFen(const std::string& fen) const {
 
 // The forward pass of the network
 float NN::forward(Accumulator& accumulator, Accumulator& activated, const Features& features, Color stm) const {
-    float output = hiddenBias[0]; // Initialize with the bias
+    return Kernels::active().forward(Kernels::view(*this), Kernels::view(features, stm), accumulator.data(), activated.data());
+}
 
-    float* stmAccumulator = accumulator.data();
-    float* nstmAccumulator = accumulator.data() + HIDDEN_SIZE;
+// The forward pass from an already computed accumulator
+float NN::forwardOutput(const float* accumulator, float* activated) const {
+    return Kernels::active().forwardOutput(Kernels::view(*this), accumulator, activated);
+}
 
-    std::memcpy(stmAccumulator, inputBias.data(), sizeof(float) * HIDDEN_SIZE);
-    std::memcpy(nstmAccumulator, inputBias.data(), sizeof(float) * HIDDEN_SIZE);
+// The feature transformer for a whole batch as one sparse x dense product.
+// Threads own a column block of the hidden layer, so every weight row block
+// is read once per batch and added into all the accumulators using it.
+void NN::forwardBatch(float* accumulators, const BatchFeatures& batch) const {
+    const auto             forwardBatchBlock = Kernels::active().forwardBatchBlock;
+    const Kernels::Network network           = Kernels::view(*this);
+    const Kernels::Batch   batchView         = Kernels::view(batch);
+
+    Tasks::pool().parallelFor(0, HIDDEN_SIZE / Kernels::BATCH_BLOCK, 1, [&](const int first, const int) {
+        forwardBatchBlock(network, batchView, accumulators, first * Kernels::BATCH_BLOCK);
+    });
+}
 
-    for (int i = 0; i < features.n; i++) {
-        for (int j = 0; j < HIDDEN_SIZE; j++) {
-            stmAccumulator[j] += inputFeatures[features.features[i][stm] * HIDDEN_SIZE + j];
-            nstmAccumulator[j] += inputFeatures[features.features[i][!stm] * HIDDEN_SIZE + j];
-        }
-    }
-    
-    #pragma omp simd reduction(+:output)
-    for (int i = 0; i < 2 * HIDDEN_SIZE; ++i){
-        activated[i] = SCReLU(accumulator[i]);
+// Every worker packs its own slice of the rows, which places those pages on its NUMA node
+void NN::setBF16(const bool enabled) {
+    inputFeaturesBF16 = Memory::Buffer<uint16_t>(enabled ? std::size_t(INPUT_SIZE) * HIDDEN_SIZE : 0);
+
+    if (enabled) {
+        Tasks::pool().onEachWorker([this](const int worker) {
+            const auto [first, last] = Tasks::slice(worker, INPUT_SIZE);
+            for (std::size_t row = first; row < last; ++row) {
+                packBF16Row(int(row));
+            }
+        });
     }
+}
 
-    #pragma omp simd reduction(+:output)
-    for (int i = 0; i < HIDDEN_SIZE; ++i){
-        output += hiddenFeatures[i] * activated[i];
-    }
+// Rounds a master row into the bf16 copy after it was updated
+void NN::packBF16Row(const int row) {
+    const float* master = inputFeatures.data() + row * HIDDEN_SIZE;
+    uint16_t*    packed = inputFeaturesBF16.data() + row * HIDDEN_SIZE;
 
-    #pragma omp simd reduction(+:output)
-    for (int i = 0; i < HIDDEN_SIZE; ++i){
-        output += hiddenFeatures[HIDDEN_SIZE + i] * activated[HIDDEN_SIZE + i];
+    for (int i = 0; i < HIDDEN_SIZE; ++i) {
+        packed[i] = toBF16(master[i]);
     }
-    
-    return output;
 }
 
-void NN::load(const std::string& path) {
-    std::ifstream file(path, std::ios::binary);
+void NN::setInt8(const bool enabled) {
+    inputFeaturesInt8 = Memory::Buffer<int8_t>(enabled ? std::size_t(INPUT_SIZE) * HIDDEN_SIZE : 0);
 
-    if (file) {
-        bool sizeMismatch = false;
+    if (enabled) {
+        Tasks::pool().onEachWorker([this](const int worker) {
+            const auto [first, last] = Tasks::slice(worker, INPUT_SIZE);
+            for (std::size_t row = first; row < last; ++row) {
+                packInt8Row(int(row));
+            }
+        });
+    }
+}
 
-        // Read inputFeatures
-        if (!file.read(reinterpret_cast<char*>(inputFeatures.data()), sizeof(inputFeatures)))
-            sizeMismatch = true;
+// Clamps a master row to the int8 range and rounds it into the int8 copy
+void NN::packInt8Row(const int row) {
+    constexpr float LIMIT = float(INT8_WEIGHT_LIMIT) / Q1;
 
-        // Read inputBias
-        if (!file.read(reinterpret_cast<char*>(inputBias.data()), sizeof(inputBias)))
-            sizeMismatch = true;
+    float*  master = inputFeatures.data() + row * HIDDEN_SIZE;
+    int8_t* packed = inputFeaturesInt8.data() + row * HIDDEN_SIZE;
 
-        // Read hiddenFeatures
-        if (!file.read(reinterpret_cast<char*>(hiddenFeatures.data()), sizeof(hiddenFeatures)))
-            sizeMismatch = true;
+    for (int i = 0; i < HIDDEN_SIZE; ++i) {
+        master[i] = std::clamp(master[i], -LIMIT, LIMIT);
+        packed[i] = int8_t(std::round(master[i] * Q1));
+    }
+}
 
-        // Read hiddenBias
-        if (!file.read(reinterpret_cast<char*>(hiddenBias.data()), sizeof(hiddenBias)))
-            sizeMismatch = true;
+void NN::packRow(const int row) {
+    if (isBF16()) {
+        packBF16Row(row);
+    } else if (isInt8()) {
+        packInt8Row(row);
+    }
+}
 
-        if (sizeMismatch) {
+void NN::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+
+    if (file) {
+        // The arena is the checkpoint format, every tensor is read at once
+        if (!file.read(reinterpret_cast<char*>(parameters.data()), sizeof(float) * Parameters::COUNT)) {
             std::cout << "Error: Checkpoint data size mismatch in " << path << std::endl;
             exit(0); // Exit
         }
 
+        setBF16(isBF16());
+        setInt8(isInt8());
+
         std::cout << "Loaded checkpoint file " << path << std::endl;
     } else {
         std::cout << "Couldn't read checkpoint file " << path << std::endl;
@@ -116,19 +149,19 @@ void NN::save(const std::string& path) {
     std::ofstream file(path, std::ios::binary);
 
     if (file) {
-        file.write(reinterpret_cast<char*>(inputFeatures.data()), sizeof(inputFeatures));
-        file.write(reinterpret_cast<char*>(inputBias.data()), sizeof(inputBias));
-        file.write(reinterpret_cast<char*>(hiddenFeatures.data()), sizeof(hiddenFeatures));
-        file.write(reinterpret_cast<char*>(hiddenBias.data()), sizeof(hiddenBias));
+        file.write(reinterpret_cast<char*>(parameters.data()), sizeof(float) * Parameters::COUNT);
     } else {
         std::cout << "Couldn't write checkpoint file " << path << std::endl;
     }
 }
 
+// A network trained with quantization-aware training exports its int8 feature transformer
 void NN::quantize(const std::string& path, bool print){
-    std::unique_ptr<QuantizedNN> qnn = std::make_unique<QuantizedNN>(*this, print);
-
-    qnn->save(path);
+    if (isInt8()) {
+        std::make_unique<QuantizedNN<int8_t>>(*this, print)->save(path);
+    } else {
+        std::make_unique<QuantizedNN<int16_t>>(*this, print)->save(path);
+    }
 
     if (print){
         std::cout << "Quantized network saved to " << path << std::endl;
@@ -3,7 +3,10 @@
 #include <cstdint>
 #include <array>
 #include <algorithm>
-#include <immintrin.h>
+#include <span>
+#include <vector>
+#include "parameters.h"
+#include "tasks.h"
 #include "types.h"
 
 template<typename T = float>
@@ -22,41 +25,6 @@ static inline const T SCReLU(const T x){
     return clipped * clipped;
 }
 
-template<std::size_t N>
-static inline void vecReLU(float* v) {
-  constexpr size_t width = sizeof(__m256) / sizeof(float);
-  constexpr size_t chunks = N / width;
-
-  const __m256 zero = _mm256_setzero_ps();
-
-  __m256* vector = (__m256*)v;
-
-  for (size_t j = 0; j < chunks; j++) vector[j] = _mm256_max_ps(zero, vector[j]);
-}
-
-template<std::size_t N>
-float vecDotProduct(float* v1, float* v2) {
-  constexpr size_t width = sizeof(__m256) / sizeof(float);
-  constexpr size_t chunks = N / width;
-
-  __m256 s0 = _mm256_setzero_ps();
-  __m256 s1 = _mm256_setzero_ps();
-
-  __m256* vector1 = (__m256*)v1;
-  __m256* vector2 = (__m256*)v2;
-
-  for (size_t j = 0; j < chunks; j += 2) {
-    s0 = _mm256_add_ps(_mm256_mul_ps(vector1[j], vector2[j]), s0);
-    s1 = _mm256_add_ps(_mm256_mul_ps(vector1[j + 1], vector2[j + 1]), s1);
-  }
-
-  const __m256 r8 = _mm256_add_ps(s0, s1);
-  const __m128 r4 = _mm_add_ps(_mm256_castps256_ps128(r8), _mm256_extractf128_ps(r8, 1));
-  const __m128 r2 = _mm_add_ps(r4, _mm_movehl_ps(r4, r4));
-  const __m128 r1 = _mm_add_ss(r2, _mm_shuffle_ps(r2, r2, 0x1));
-  return _mm_cvtss_f32(r1);
-}
-
 template<typename T = float>
 static inline const T ReLUPrime(const T x){
     return x > 0 ? 1 : 0;
@@ -87,6 +55,29 @@ inline float errorFunction(float output, float eval, float wdl) {
     return pow(sigmoid(output) - expected, 2);
 }
 
+static inline float errorFunction(float output, float expected) {
+    return pow(sigmoid(output) - expected, 2);
+}
+
+static inline float errorGradient(float output, float expected) {
+    return 2 * (sigmoid(output) - expected);
+}
+
+// bf16 is the upper half of an fp32, rounded to nearest even
+static inline uint16_t toBF16(const float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return uint16_t(bits >> 16);
+}
+
+static inline float fromBF16(const uint16_t x) {
+    const uint32_t bits = uint32_t(x) << 16;
+    float          result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
 struct Features
 {
     uint8_t n = 0;
@@ -107,24 +98,54 @@ struct Features
     }
 };
 
+// CSR view of the active features of a whole batch, the accumulator halves
+// using input row r are entries[rowOffsets[r]] .. entries[rowOffsets[r + 1] - 1],
+// where an entry is sample * 2 + (0 for the stm half, 1 for the nstm half)
+struct BatchFeatures
+{
+    std::size_t      size = 0;
+    std::vector<int> rowOffsets;
+    std::vector<int> entries;
+};
+
 struct NN {
     using Accumulator = std::array<float, HIDDEN_SIZE * 2>;
     using Color = uint8_t;
 
-    std::array<float, INPUT_SIZE * HIDDEN_SIZE> inputFeatures;
-    std::array<float, HIDDEN_SIZE> inputBias;
-    std::array<float, HIDDEN_SIZE * 2> hiddenFeatures;
-    std::array<float, OUTPUT_SIZE> hiddenBias;
+    // All weights in the layout of Parameters, the tensors below are views of it
+    Parameters::Arena parameters = Parameters::Arena(Parameters::SIZE);
+
+    std::span<float> inputFeatures{parameters.data() + Parameters::INPUT_FEATURES, std::size_t(INPUT_SIZE) * HIDDEN_SIZE};
+    std::span<float> inputBias{parameters.data() + Parameters::INPUT_BIAS, HIDDEN_SIZE};
+    std::span<float> hiddenFeatures{parameters.data() + Parameters::HIDDEN_FEATURES, HIDDEN_SIZE * 2};
+    std::span<float> hiddenBias{parameters.data() + Parameters::HIDDEN_BIAS, OUTPUT_SIZE};
+
+    // bf16 copy of inputFeatures read by the forward pass in mixed precision mode, empty otherwise.
+    // inputFeatures stays the fp32 master the optimizer updates, so the copy adds memory. Like the
+    // master, its rows are first touched by the worker owning them.
+    Memory::Buffer<uint16_t> inputFeaturesBF16;
+
+    // int8 copy of inputFeatures in units of 1 / Q1 for quantization-aware training, empty otherwise.
+    // The forward pass sees the weights of the int8 feature transformer the quantizer exports, while
+    // the gradients pass straight through to the fp32 master, which is clamped to the int8 range.
+    Memory::Buffer<int8_t> inputFeaturesInt8;
 
     NN(){
         std::random_device rd;
         std::mt19937                    gen(rd());
-        std::normal_distribution<float> input_distribution(0.0, std::sqrt(1.0 / static_cast<float>(32)));
         std::normal_distribution<float> hidden_distribution(0.0, std::sqrt(1.0 / static_cast<float>(HIDDEN_SIZE)));
 
-        for (int i = 0; i < INPUT_SIZE * HIDDEN_SIZE; i++) {
-            inputFeatures[i] = input_distribution(gen);
-        }
+        // Every worker initializes its own slice of the rows, which places those pages on its NUMA node
+        const unsigned seed = rd();
+        Tasks::pool().onEachWorker([this, seed](const int worker) {
+            std::mt19937                    gen(seed + worker);
+            std::normal_distribution<float> input_distribution(0.0, std::sqrt(1.0 / static_cast<float>(32)));
+
+            const auto [first, last] = Tasks::slice(worker, INPUT_SIZE);
+            for (std::size_t i = first * HIDDEN_SIZE; i < last * HIDDEN_SIZE; i++) {
+                inputFeatures[i] = input_distribution(gen);
+            }
+        });
 
         for (int i = 0; i < HIDDEN_SIZE * 2; i++) {
             hiddenFeatures[i] = hidden_distribution(gen);
@@ -134,7 +155,28 @@ struct NN {
         std::memset(hiddenBias.data(), 0, sizeof(float) * OUTPUT_SIZE);
     }
 
+    // The views point into the own arena
+    NN(const NN&)            = delete;
+    NN& operator=(const NN&) = delete;
+
     float forward(Accumulator& accumulator, Accumulator& activated, const Features& features, Color stm) const;
+    float forwardOutput(const float* accumulator, float* activated) const;
+    void  forwardBatch(float* accumulators, const BatchFeatures& batch) const;
+    void  setBF16(bool enabled);
+    void  packBF16Row(int row);
+    bool  isBF16() const {
+        return !inputFeaturesBF16.empty();
+    }
+    void  setInt8(bool enabled);
+    void  packInt8Row(int row);
+    bool  isInt8() const {
+        return !inputFeaturesInt8.empty();
+    }
+    // Refreshes the low precision copy of a row after the optimizer updated it
+    void  packRow(int row);
+    bool  isPacked() const {
+        return isBF16() || isInt8();
+    }
     void testFen(const std::string& fen) const;
     void load(const std::string& path);
     void save(const std::string& path);
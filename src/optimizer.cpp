@@ -3,26 +3,104 @@
 #include <algorithm>
 
 namespace Optimizer {
-    void Adam::update(float& v, Gradient& grad, const float gsum, const float learningRate) {
-        grad.M = beta1 * grad.M + (1 - beta1) * gsum;
-        grad.V = beta2 * grad.V + (1 - beta2) * gsum * gsum;
+    void Adam::update(float& v, float& m, float& s, const float gsum, const float learningRate) const {
+        m = beta1 * m + (1 - beta1) * gsum;
+        s = beta2 * s + (1 - beta2) * gsum * gsum;
 
-        v -= learningRate * grad.M / (sqrt(grad.V) + epsilon);
+        v -= learningRate * m / (sqrt(s) + epsilon);
     }
 
-    void AdamW::update(float& v, Gradient& grad, const float gsum, const float learningRate) {
+    // A row without gradient for `skipped` steps: M and V decay geometrically and the weights keep
+    // moving by M / sqrt(V), which shrinks by beta1 / sqrt(beta2) per step. Epsilon is only
+    // applied to the first of those steps and the learning rate is the current one.
+    Optimizer::Decay Adam::decay(const std::int64_t skipped, const float learningRate) const {
+        return {1.0f,
+                learningRate * skippedStepsSum(1.0f, beta1 / std::sqrt(beta2), skipped),
+                std::pow(beta1, float(skipped)),
+                std::pow(beta2, float(skipped))};
+    }
+
+    void Adam::catchUp(float* v, float* m, float* s, const int size, const Decay& decay) const {
+        for (int i = 0; i < size; ++i) {
+            v[i] = decay.weight * v[i] - decay.drift * m[i] / (std::sqrt(s[i]) + epsilon);
+            m[i] *= decay.first;
+            s[i] *= decay.second;
+        }
+    }
+
+    void AdamW::update(float& v, float& m, float& s, const float gsum, const float learningRate) const {
         const float decay = 1.0 - 0.01 * learningRate;
         v *= decay;
-        grad.M = beta1 * grad.M + (1 - beta1) * gsum;
-        grad.V = beta2 * grad.V + (1 - beta2) * gsum * gsum;
+        m = beta1 * m + (1 - beta1) * gsum;
+        s = beta2 * s + (1 - beta2) * gsum * gsum;
 
-        v -= learningRate * grad.M / (sqrt(grad.V) + epsilon);
+        v -= learningRate * m / (sqrt(s) + epsilon);
     }
 
-    void Adamax::update(float& v, Gradient& grad, const float gsum, const float learningRate) {
-        grad.M = beta1 * grad.M + (1 - beta1) * gsum;
-        grad.V = std::max(beta2 * grad.V, std::abs(gsum));
+    // As Adam, with the weight decay of every skipped step applied as well
+    Optimizer::Decay AdamW::decay(const std::int64_t skipped, const float learningRate) const {
+        const float weightDecay = 1.0 - 0.01 * learningRate;
+
+        return {std::pow(weightDecay, float(skipped)),
+                learningRate * skippedStepsSum(weightDecay, beta1 / std::sqrt(beta2), skipped),
+                std::pow(beta1, float(skipped)),
+                std::pow(beta2, float(skipped))};
+    }
+
+    void AdamW::catchUp(float* v, float* m, float* s, const int size, const Decay& decay) const {
+        for (int i = 0; i < size; ++i) {
+            v[i] = decay.weight * v[i] - decay.drift * m[i] / (std::sqrt(s[i]) + epsilon);
+            m[i] *= decay.first;
+            s[i] *= decay.second;
+        }
+    }
+
+    void Adamax::update(float& v, float& m, float& s, const float gsum, const float learningRate) const {
+        m = beta1 * m + (1 - beta1) * gsum;
+        s = std::max(beta2 * s, std::abs(gsum));
+
+        v -= learningRate * m / (s + EPSILON);
+    }
+
+    // Without gradient the infinity norm only decays, so the update shrinks by beta1 / beta2 per step
+    Optimizer::Decay Adamax::decay(const std::int64_t skipped, const float learningRate) const {
+        return {1.0f,
+                learningRate * skippedStepsSum(1.0f, beta1 / beta2, skipped),
+                std::pow(beta1, float(skipped)),
+                std::pow(beta2, float(skipped))};
+    }
+
+    void Adamax::catchUp(float* v, float* m, float* s, const int size, const Decay& decay) const {
+        for (int i = 0; i < size; ++i) {
+            v[i] -= decay.drift * m[i] / (s[i] + EPSILON);
+            m[i] *= decay.first;
+            s[i] *= decay.second;
+        }
+    }
+
+    void Lion::update(float& v, float& momentum, const float gsum, const float learningRate) const {
+        const float direction = beta1 * momentum + (1 - beta1) * gsum;
+
+        v *= 1 - learningRate * weightDecay;
+        v -= learningRate * ((direction > 0) - (direction < 0));
+        momentum = beta2 * momentum + (1 - beta2) * gsum;
+    }
+
+    // Without gradient the momentum only decays and keeps its sign, so every skipped step moves
+    // the weight by the learning rate in the same direction, on top of the weight decay
+    Optimizer::Decay Lion::decay(const std::int64_t skipped, const float learningRate) const {
+        const float perStep = 1 - learningRate * weightDecay;
+
+        return {std::pow(perStep, float(skipped)),
+                learningRate * skippedStepsSum(perStep, 1.0f, skipped),
+                std::pow(beta2, float(skipped)),
+                1.0f};
+    }
 
-        v -= learningRate * grad.M / (grad.V + EPSILON);
+    void Lion::catchUp(float* v, float* momentum, const int size, const Decay& decay) const {
+        for (int i = 0; i < size; ++i) {
+            v[i]        = decay.weight * v[i] - decay.drift * ((momentum[i] > 0) - (momentum[i] < 0));
+            momentum[i] *= decay.first;
+        }
     }
 } // namespace Optimizer
\ No newline at end of file
@@ -1,15 +1,43 @@
 #pragma once
 
 #include "gradient.h"
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <type_traits>
+#include <variant>
 
 namespace Optimizer {
     constexpr float BETA1   = 0.9f;
     constexpr float BETA2   = 0.999f;
     constexpr float EPSILON = 1e-8f;
 
+    // Sum of d^(k-t) * q^t over t = 1..k, the weight movement of k steps without gradient
+    // where d is the weight decay per step and q the decay of the update per step
+    static inline float skippedStepsSum(const float d, const float q, const std::int64_t k) {
+        if (std::abs(d - q) < 1e-6f) {
+            return k * std::pow(q, float(k));
+        }
+        return q * (std::pow(d, float(k)) - std::pow(q, float(k))) / (d - q);
+    }
+
     class Optimizer {
     public:
-        int   steps        = 0;
+        // Multipliers of a number of steps without gradient, computed once per row by decay()
+        // and applied to every weight of it by catchUp()
+        struct Decay {
+            // Of the weights, from weight decay
+            float weight;
+            // Learning rate times the summed decay of the update
+            float drift;
+            // Of M, or of the momentum
+            float first;
+            // Of V
+            float second;
+        };
+
+        // 64 bit, Hogwild counts a step per sample
+        std::int64_t steps = 0;
 
         void step(){
             ++steps;
@@ -33,7 +61,24 @@ namespace Optimizer {
             
         }
 
-        void update(float& v, Gradient& grad, const float gsum, const float learningRate);
+        void update(float& v, float& m, float& s, const float gsum, const float learningRate) const;
+        Decay decay(const std::int64_t skipped, const float learningRate) const;
+        void  catchUp(float* v, float* m, float* s, const int size, const Decay& decay) const;
+
+        // update() on a vector of weights, for the row kernels in kernels_impl.h
+        template<typename Arch>
+        inline void update(typename Arch::Reg& v, typename Arch::Reg& m, typename Arch::Reg& s, const typename Arch::Reg gsum, const float learningRate) const {
+            m = Arch::fmadd(Arch::set1(beta1), m, Arch::mul(Arch::set1(1 - beta1), gsum));
+            s = Arch::fmadd(Arch::set1(beta2), s, Arch::mul(Arch::set1(1 - beta2), Arch::mul(gsum, gsum)));
+            v = Arch::sub(v, Arch::div(Arch::mul(Arch::set1(learningRate), m), Arch::add(Arch::sqrt(s), Arch::set1(epsilon))));
+        }
+
+        template<typename Arch>
+        inline void catchUp(typename Arch::Reg& v, typename Arch::Reg& m, typename Arch::Reg& s, const Decay& decay) const {
+            v = Arch::sub(Arch::mul(Arch::set1(decay.weight), v), Arch::div(Arch::mul(Arch::set1(decay.drift), m), Arch::add(Arch::sqrt(s), Arch::set1(epsilon))));
+            m = Arch::mul(m, Arch::set1(decay.first));
+            s = Arch::mul(s, Arch::set1(decay.second));
+        }
 
         friend std::ostream& operator<<(std::ostream& os, const Adam& adam) {
             os << "Adam(" << "beta1=" << adam.beta1 << ", beta2=" << adam.beta2 << ", epsilon=" << adam.epsilon << ")";
@@ -55,7 +100,25 @@ namespace Optimizer {
             
         }
 
-        void update(float& v, Gradient& grad, const float gsum, const float learningRate);
+        void update(float& v, float& m, float& s, const float gsum, const float learningRate) const;
+        Decay decay(const std::int64_t skipped, const float learningRate) const;
+        void  catchUp(float* v, float* m, float* s, const int size, const Decay& decay) const;
+
+        template<typename Arch>
+        inline void update(typename Arch::Reg& v, typename Arch::Reg& m, typename Arch::Reg& s, const typename Arch::Reg gsum, const float learningRate) const {
+            const float decay = 1.0 - 0.01 * learningRate;
+            v = Arch::mul(v, Arch::set1(decay));
+            m = Arch::fmadd(Arch::set1(beta1), m, Arch::mul(Arch::set1(1 - beta1), gsum));
+            s = Arch::fmadd(Arch::set1(beta2), s, Arch::mul(Arch::set1(1 - beta2), Arch::mul(gsum, gsum)));
+            v = Arch::sub(v, Arch::div(Arch::mul(Arch::set1(learningRate), m), Arch::add(Arch::sqrt(s), Arch::set1(epsilon))));
+        }
+
+        template<typename Arch>
+        inline void catchUp(typename Arch::Reg& v, typename Arch::Reg& m, typename Arch::Reg& s, const Decay& decay) const {
+            v = Arch::sub(Arch::mul(Arch::set1(decay.weight), v), Arch::div(Arch::mul(Arch::set1(decay.drift), m), Arch::add(Arch::sqrt(s), Arch::set1(epsilon))));
+            m = Arch::mul(m, Arch::set1(decay.first));
+            s = Arch::mul(s, Arch::set1(decay.second));
+        }
 
         friend std::ostream& operator<<(std::ostream& os, const AdamW& adamw) {
             os << "AdamW(" << "beta1=" << adamw.beta1 << ", beta2=" << adamw.beta2 << ", epsilon=" << adamw.epsilon << ")";
@@ -77,11 +140,80 @@ namespace Optimizer {
             
         }
 
-        void update(float& v, Gradient& grad, const float gsum, const float learningRate);
+        void update(float& v, float& m, float& s, const float gsum, const float learningRate) const;
+        Decay decay(const std::int64_t skipped, const float learningRate) const;
+        void  catchUp(float* v, float* m, float* s, const int size, const Decay& decay) const;
+
+        template<typename Arch>
+        inline void update(typename Arch::Reg& v, typename Arch::Reg& m, typename Arch::Reg& s, const typename Arch::Reg gsum, const float learningRate) const {
+            m = Arch::fmadd(Arch::set1(beta1), m, Arch::mul(Arch::set1(1 - beta1), gsum));
+            s = Arch::max(Arch::mul(Arch::set1(beta2), s), Arch::abs(gsum));
+            v = Arch::sub(v, Arch::div(Arch::mul(Arch::set1(learningRate), m), Arch::add(s, Arch::set1(EPSILON))));
+        }
+
+        template<typename Arch>
+        inline void catchUp(typename Arch::Reg& v, typename Arch::Reg& m, typename Arch::Reg& s, const Decay& decay) const {
+            v = Arch::sub(v, Arch::div(Arch::mul(Arch::set1(decay.drift), m), Arch::add(s, Arch::set1(EPSILON))));
+            m = Arch::mul(m, Arch::set1(decay.first));
+            s = Arch::mul(s, Arch::set1(decay.second));
+        }
 
         friend std::ostream& operator<<(std::ostream& os, const Adamax& adamax) {
             os << "Adamax(" << "beta1=" << adamax.beta1 << ", beta2=" << adamax.beta2 << ", epsilon=" << adamax.epsilon << ")";
             return os;
         }
     };
+
+    // Lion keeps a single momentum per weight and steps by the sign of an interpolation
+    // between the momentum and the gradient, so every weight moves by the learning rate
+    class Lion : public Optimizer {
+    public:
+        static constexpr float DEFAULT_BETA1        = 0.9f;
+        static constexpr float DEFAULT_BETA2        = 0.99f;
+        static constexpr float DEFAULT_WEIGHT_DECAY = 0.01f;
+
+        float beta1       = DEFAULT_BETA1;
+        float beta2       = DEFAULT_BETA2;
+        float weightDecay = DEFAULT_WEIGHT_DECAY;
+
+        Lion(float _beta1 = DEFAULT_BETA1, float _beta2 = DEFAULT_BETA2, float _weightDecay = DEFAULT_WEIGHT_DECAY) : beta1(_beta1), beta2(_beta2), weightDecay(_weightDecay) {
+
+        }
+
+        void update(float& v, float& momentum, const float gsum, const float learningRate) const;
+        Decay decay(const std::int64_t skipped, const float learningRate) const;
+        void  catchUp(float* v, float* momentum, const int size, const Decay& decay) const;
+
+        template<typename Arch>
+        inline void update(typename Arch::Reg& v, typename Arch::Reg& momentum, const typename Arch::Reg gsum, const float learningRate) const {
+            const typename Arch::Reg direction = Arch::fmadd(Arch::set1(beta1), momentum, Arch::mul(Arch::set1(1 - beta1), gsum));
+
+            v        = Arch::mul(v, Arch::set1(1 - learningRate * weightDecay));
+            v        = Arch::sub(v, Arch::mul(Arch::set1(learningRate), Arch::sign(direction)));
+            momentum = Arch::fmadd(Arch::set1(beta2), momentum, Arch::mul(Arch::set1(1 - beta2), gsum));
+        }
+
+        template<typename Arch>
+        inline void catchUp(typename Arch::Reg& v, typename Arch::Reg& momentum, const Decay& decay) const {
+            v        = Arch::sub(Arch::mul(Arch::set1(decay.weight), v), Arch::mul(Arch::set1(decay.drift), Arch::sign(momentum)));
+            momentum = Arch::mul(momentum, Arch::set1(decay.first));
+        }
+
+        friend std::ostream& operator<<(std::ostream& os, const Lion& lion) {
+            os << "Lion(" << "beta1=" << lion.beta1 << ", beta2=" << lion.beta2 << ", weight_decay=" << lion.weightDecay << ")";
+            return os;
+        }
+    };
+
+    // Optimizer picked at runtime, the trainer dispatches on it once per step
+    using Any = std::variant<AdamW, Adam, Adamax, Lion>;
+
+    // Optimizers keeping a single momentum per weight instead of M and V
+    template<typename T>
+    constexpr bool MOMENTUM_ONLY = std::is_same_v<T, Lion>;
+
+    inline std::ostream& operator<<(std::ostream& os, const Any& optimizer) {
+        std::visit([&os](const auto& selected) { os << selected; }, optimizer);
+        return os;
+    }
 } // namespace Optimizer
\ No newline at end of file
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "memory.h"
+#include "types.h"
+#include <cstddef>
+
+// Every parameter of the network lives in one flat arena of floats, and the tensors of NN are views of
+// it at the offsets below. The optimizer state is kept in arenas of the same layout, one per moment, so
+// a tensor offset addresses its weights and its state alike and a pass over the whole model is a single
+// loop. The tensors are packed in the order of the checkpoint format, a checkpoint is the arena itself.
+namespace Parameters {
+
+    // Tensors start on 64 byte boundaries
+    constexpr std::size_t ALIGNMENT = 64 / sizeof(float);
+
+    constexpr std::size_t aligned(const std::size_t floats) {
+        return (floats + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+    // Offsets of the tensors in floats
+    constexpr std::size_t INPUT_FEATURES  = 0;
+    constexpr std::size_t INPUT_BIAS      = aligned(INPUT_FEATURES + std::size_t(INPUT_SIZE) * HIDDEN_SIZE);
+    constexpr std::size_t HIDDEN_FEATURES = aligned(INPUT_BIAS + HIDDEN_SIZE);
+    constexpr std::size_t HIDDEN_BIAS     = aligned(HIDDEN_FEATURES + HIDDEN_SIZE * 2);
+
+    // Parameters of the network, and the size of an arena padded to whole cache lines
+    constexpr std::size_t COUNT = HIDDEN_BIAS + OUTPUT_SIZE;
+    constexpr std::size_t SIZE  = aligned(COUNT);
+
+    static_assert(COUNT == std::size_t(INPUT_SIZE) * HIDDEN_SIZE + HIDDEN_SIZE * 3 + OUTPUT_SIZE, "the tensors must be packed to match the checkpoint format");
+
+    // SIZE floats of the large object arena, zero until written
+    using Arena = Memory::Buffer<float>;
+
+} // namespace Parameters
@@ -2,7 +2,8 @@
 #include "dataloader.h"
 #include "nn.h"
 
-void QuantizedNN::testFen(const std::string& fen){
+template<typename InputType>
+void QuantizedNN<InputType>::testFen(const std::string& fen){
     chess::Position pos{chess::Position::fromFen(fen)};
 
     Features features;
@@ -25,18 +26,20 @@ void QuantizedNN::testFen(const std::string& fen){
 
     Accumulator accumulator;
     Color       stm = Color(pos.sideToMove());
-    
+
     std::cout << "Score: " << forward(accumulator, features, stm) << std::endl;
 }
 
-const int32_t QuantizedNN::forward(Accumulator& accumulator, Features& features, Color stm) const{
-    int32_t output = hiddenBias[0]; // Initialize with the bias
-
+// The accumulator is in units of 1 / Q1, SCReLU clamps it to [0, Q1] and squares it. The products
+// with the hidden weights are in units of 1 / (Q1 * Q1 * Q2), one division by Q1 brings the sum to
+// the scale of the hidden bias. The sum is kept in 64 bits, large hidden weights overflow 32.
+template<typename InputType>
+int64_t QuantizedNN<InputType>::output(Accumulator& accumulator, const Features& features, Color stm) const{
     auto* stmAccumulator = accumulator.data();
     auto* nstmAccumulator = accumulator.data() + HIDDEN_SIZE;
 
-    std::memcpy(stmAccumulator, inputBias.data(), sizeof(float) * HIDDEN_SIZE);
-    std::memcpy(nstmAccumulator, inputBias.data(), sizeof(float) * HIDDEN_SIZE);
+    std::memcpy(stmAccumulator, inputBias.data(), sizeof(bias_type) * HIDDEN_SIZE);
+    std::memcpy(nstmAccumulator, inputBias.data(), sizeof(bias_type) * HIDDEN_SIZE);
 
     for (int i = 0; i < features.n; i++) {
         for (int j = 0; j < HIDDEN_SIZE; j++) {
@@ -44,20 +47,27 @@ const int32_t QuantizedNN::forward(Accumulator& accumulator, Features& features,
             nstmAccumulator[j] += inputFeatures[features.features[i][!stm] * HIDDEN_SIZE + j];
         }
     }
-    
+
+    int64_t sum = 0;
+
+    #pragma omp simd reduction(+:sum)
     for (int i = 0; i < HIDDEN_SIZE * 2; ++i){
-        accumulator[i] = SCReLU(accumulator[i]);
+        const int32_t activated = std::clamp<int32_t>(accumulator[i], 0, Q1);
+        sum += int64_t(activated * activated) * hiddenFeatures[i];
     }
 
-    #pragma omp simd reduction(+:output)
-    for (int i = 0; i < HIDDEN_SIZE; ++i){
-        output += hiddenFeatures[i] * stmAccumulator[i];
-    }
+    return sum / Q1 + hiddenBias[0];
+}
 
-    #pragma omp simd reduction(+:output)
-    for (int i = 0; i < HIDDEN_SIZE; ++i){
-        output += hiddenFeatures[HIDDEN_SIZE + i] * nstmAccumulator[i];
-    }
-    
-    return output / (Q1 * Q2);
-}
\ No newline at end of file
+template<typename InputType>
+const int32_t QuantizedNN<InputType>::forward(Accumulator& accumulator, const Features& features, Color stm) const{
+    return int32_t(output(accumulator, features, stm) / (Q1 * Q2));
+}
+
+template<typename InputType>
+int32_t QuantizedNN<InputType>::evaluate(Accumulator& accumulator, const Features& features, Color stm) const{
+    return int32_t(output(accumulator, features, stm) * int64_t(EVAL_SCALE) / (Q1 * Q2));
+}
+
+template class QuantizedNN<int16_t>;
+template class QuantizedNN<int8_t>;
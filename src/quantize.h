@@ -2,24 +2,30 @@
 
 #include "types.h"
 #include "nn.h"
+#include <cmath>
 #include <iostream>
 #include <fstream>
+#include <limits>
 
-constexpr int Q1 = 181;
-constexpr int Q2 = 128;
-
+// Integer network of the engine. The input weights are int16, or int8 for a network trained with
+// quantization-aware training, the input bias is int16 in both cases.
+template<typename InputType = int16_t>
 class QuantizedNN {
     public:
-    using input_type = int16_t;
+    using input_type = InputType;
+    using bias_type = int16_t;
     using hidden_type = int16_t;
     using Accumulator = std::array<int16_t, HIDDEN_SIZE * 2>;
     using Color = uint8_t;
 
     std::array<input_type, INPUT_SIZE * HIDDEN_SIZE> inputFeatures;
-    std::array<input_type, HIDDEN_SIZE> inputBias;
+    std::array<bias_type, HIDDEN_SIZE> inputBias;
     std::array<hidden_type, HIDDEN_SIZE * 2> hiddenFeatures;
     std::array<int32_t, OUTPUT_SIZE> hiddenBias;
 
+    // Input weights outside the range of input_type, saturated
+    std::size_t clipped = 0;
+
     QuantizedNN(const NN& nn, bool print = false){
         float inputMax = 0.0f;
         float inputBiasMax = 0.0f;
@@ -29,8 +35,7 @@ class QuantizedNN {
         for (int i = 0; i < INPUT_SIZE * HIDDEN_SIZE; i++) {
             float w = nn.inputFeatures[i];
             inputMax = std::max(inputMax, w);
-            int16_t a = static_cast<int16_t>(std::round(w * Q1));
-            inputFeatures[i] = a;
+            inputFeatures[i] = saturate<input_type>(std::round(w * Q1));
         }
 
         for (int i = 0; i < HIDDEN_SIZE; i++) {
@@ -59,6 +64,9 @@ class QuantizedNN {
             std::cout << "inputBiasMax: " << inputBiasMax << "\n";
             std::cout << "hiddenMax: " << hiddenMax << "\n";
             std::cout << "hiddenBiasMax: " << hiddenBiasMax << "\n";
+            if (clipped > 0) {
+                std::cout << "clipped input weights: " << clipped << "\n";
+            }
         }
     }
 
@@ -76,7 +84,12 @@ class QuantizedNN {
     }
 
     void testFen(const std::string& fen);
-    const int32_t forward(Accumulator& accumulator, Features& features, Color stm) const;
+
+    // Output of the network in the units of the float one, truncated to an integer
+    const int32_t forward(Accumulator& accumulator, const Features& features, Color stm) const;
+
+    // Evaluation in centipawns, the float network would return output * EVAL_SCALE
+    int32_t evaluate(Accumulator& accumulator, const Features& features, Color stm) const;
 
     friend std::ostream& operator<<(std::ostream& os, const QuantizedNN& nn) {
         os << "Neural Network Summary:" << std::endl;
@@ -105,4 +118,45 @@ class QuantizedNN {
 
         return os;
     }
+
+    private:
+    // Output in units of 1 / (Q1 * Q2)
+    int64_t output(Accumulator& accumulator, const Features& features, Color stm) const;
+
+    template<typename T>
+    T saturate(const float x) {
+        constexpr float LOW  = std::numeric_limits<T>::min();
+        constexpr float HIGH = std::numeric_limits<T>::max();
+
+        if (x < LOW || x > HIGH) {
+            clipped++;
+        }
+        return static_cast<T>(std::clamp(x, LOW, HIGH));
+    }
 };
+
+// Difference of the quantized evaluation to the float one over a set of positions, in centipawns
+struct QuantizationError {
+    std::size_t positions = 0;
+    double      total     = 0;
+    double      max       = 0;
+
+    void add(const double error) {
+        positions++;
+        total += error;
+        max = std::max(max, error);
+    }
+
+    void merge(const QuantizationError& other) {
+        positions += other.positions;
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+
+    double mean() const {
+        return positions > 0 ? total / positions : 0;
+    }
+};
+
+extern template class QuantizedNN<int16_t>;
+extern template class QuantizedNN<int8_t>;
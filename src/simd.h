@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+// Vector types the kernels are written against. load() also widens bf16 weights. Each one only exists in the
+// translation units built for its instruction set, see kernels_*.cpp, and has internal linkage there.
+namespace Kernels {
+namespace {
+
+#if defined(__AVX512F__)
+    struct AVX512 {
+        using Reg = __m512;
+
+        static constexpr int WIDTH = 16;
+
+        static inline Reg zero() {
+            return _mm512_setzero_ps();
+        }
+        static inline Reg set1(const float x) {
+            return _mm512_set1_ps(x);
+        }
+        static inline Reg load(const float* p) {
+            return _mm512_loadu_ps(p);
+        }
+        static inline Reg load(const uint16_t* p) {
+            const __m512i widened = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+            return _mm512_castsi512_ps(_mm512_slli_epi32(widened, 16));
+        }
+        static inline void store(float* p, const Reg x) {
+            _mm512_storeu_ps(p, x);
+        }
+        static inline Reg add(const Reg a, const Reg b) {
+            return _mm512_add_ps(a, b);
+        }
+        static inline Reg mul(const Reg a, const Reg b) {
+            return _mm512_mul_ps(a, b);
+        }
+        static inline Reg fmadd(const Reg a, const Reg b, const Reg c) {
+            return _mm512_fmadd_ps(a, b, c);
+        }
+        static inline Reg sub(const Reg a, const Reg b) {
+            return _mm512_sub_ps(a, b);
+        }
+        static inline Reg div(const Reg a, const Reg b) {
+            return _mm512_div_ps(a, b);
+        }
+        static inline Reg sqrt(const Reg x) {
+            return _mm512_sqrt_ps(x);
+        }
+        static inline Reg max(const Reg a, const Reg b) {
+            return _mm512_max_ps(a, b);
+        }
+        static inline Reg abs(const Reg x) {
+            return _mm512_abs_ps(x);
+        }
+        static inline Reg min(const Reg a, const Reg b) {
+            return _mm512_min_ps(a, b);
+        }
+        static inline Reg ceil(const Reg x) {
+            return _mm512_roundscale_ps(x, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC);
+        }
+        // |x| with the sign of s
+        static inline Reg withSign(const Reg x, const Reg s) {
+            return _mm512_or_ps(x, _mm512_and_ps(s, set1(-0.0f)));
+        }
+        // 1, -1 or 0
+        static inline Reg sign(const Reg x) {
+            return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(x, zero(), _CMP_NEQ_OQ), withSign(set1(1.0f), x));
+        }
+        // WIDTH 8 bit codes, stores round to nearest and saturate
+        static inline Reg loadInt8(const int8_t* p) {
+            return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+        }
+        static inline Reg loadUint8(const uint8_t* p) {
+            return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+        }
+        static inline void storeInt8(int8_t* p, const Reg x) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm512_cvtsepi32_epi8(_mm512_cvtps_epi32(x)));
+        }
+        static inline void storeUint8(uint8_t* p, const Reg x) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm512_cvtusepi32_epi8(_mm512_max_epi32(_mm512_cvtps_epi32(x), _mm512_setzero_si512())));
+        }
+        static inline Reg screlu(const Reg x) {
+            const Reg clipped = _mm512_min_ps(_mm512_max_ps(x, zero()), set1(1.0f));
+            return _mm512_mul_ps(clipped, clipped);
+        }
+        static inline Reg screluPrime(const Reg x) {
+            const __mmask16 inside = _mm512_cmp_ps_mask(x, zero(), _CMP_GT_OQ) & _mm512_cmp_ps_mask(x, set1(1.0f), _CMP_LT_OQ);
+            return _mm512_maskz_add_ps(inside, x, x);
+        }
+        static inline float sum(const Reg x) {
+            return _mm512_reduce_add_ps(x);
+        }
+        static inline float maxOf(const Reg x) {
+            return _mm512_reduce_max_ps(x);
+        }
+        // Bit i is set if lane i is not zero
+        static inline int nonZero(const Reg x) {
+            return _mm512_cmp_ps_mask(x, zero(), _CMP_NEQ_UQ);
+        }
+    };
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+    struct AVX2 {
+        using Reg = __m256;
+
+        static constexpr int WIDTH = 8;
+
+        static inline Reg zero() {
+            return _mm256_setzero_ps();
+        }
+        static inline Reg set1(const float x) {
+            return _mm256_set1_ps(x);
+        }
+        static inline Reg load(const float* p) {
+            return _mm256_loadu_ps(p);
+        }
+        static inline Reg load(const uint16_t* p) {
+            const __m256i widened = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+            return _mm256_castsi256_ps(_mm256_slli_epi32(widened, 16));
+        }
+        static inline void store(float* p, const Reg x) {
+            _mm256_storeu_ps(p, x);
+        }
+        static inline Reg add(const Reg a, const Reg b) {
+            return _mm256_add_ps(a, b);
+        }
+        static inline Reg mul(const Reg a, const Reg b) {
+            return _mm256_mul_ps(a, b);
+        }
+        static inline Reg fmadd(const Reg a, const Reg b, const Reg c) {
+            return _mm256_fmadd_ps(a, b, c);
+        }
+        static inline Reg sub(const Reg a, const Reg b) {
+            return _mm256_sub_ps(a, b);
+        }
+        static inline Reg div(const Reg a, const Reg b) {
+            return _mm256_div_ps(a, b);
+        }
+        static inline Reg sqrt(const Reg x) {
+            return _mm256_sqrt_ps(x);
+        }
+        static inline Reg max(const Reg a, const Reg b) {
+            return _mm256_max_ps(a, b);
+        }
+        static inline Reg abs(const Reg x) {
+            return _mm256_andnot_ps(set1(-0.0f), x);
+        }
+        static inline Reg min(const Reg a, const Reg b) {
+            return _mm256_min_ps(a, b);
+        }
+        static inline Reg ceil(const Reg x) {
+            return _mm256_ceil_ps(x);
+        }
+        // |x| with the sign of s
+        static inline Reg withSign(const Reg x, const Reg s) {
+            return _mm256_or_ps(x, _mm256_and_ps(s, set1(-0.0f)));
+        }
+        // 1, -1 or 0
+        static inline Reg sign(const Reg x) {
+            return _mm256_and_ps(_mm256_cmp_ps(x, zero(), _CMP_NEQ_OQ), withSign(set1(1.0f), x));
+        }
+        // WIDTH 8 bit codes, stores round to nearest and saturate
+        static inline Reg loadInt8(const int8_t* p) {
+            return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+        }
+        static inline Reg loadUint8(const uint8_t* p) {
+            return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+        }
+        static inline void storeInt8(int8_t* p, const Reg x) {
+            const __m256i codes = _mm256_cvtps_epi32(x);
+            const __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(codes), _mm256_extracti128_si256(codes, 1));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packs_epi16(words, words));
+        }
+        static inline void storeUint8(uint8_t* p, const Reg x) {
+            const __m256i codes = _mm256_cvtps_epi32(x);
+            const __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(codes), _mm256_extracti128_si256(codes, 1));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi16(words, words));
+        }
+        static inline Reg screlu(const Reg x) {
+            const Reg clipped = _mm256_min_ps(_mm256_max_ps(x, zero()), set1(1.0f));
+            return _mm256_mul_ps(clipped, clipped);
+        }
+        static inline Reg screluPrime(const Reg x) {
+            const Reg inside = _mm256_and_ps(_mm256_cmp_ps(x, zero(), _CMP_GT_OQ), _mm256_cmp_ps(x, set1(1.0f), _CMP_LT_OQ));
+            return _mm256_and_ps(inside, _mm256_add_ps(x, x));
+        }
+        static inline float sum(const Reg x) {
+            const __m128 r4 = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+            const __m128 r2 = _mm_add_ps(r4, _mm_movehl_ps(r4, r4));
+            const __m128 r1 = _mm_add_ss(r2, _mm_shuffle_ps(r2, r2, 0x1));
+            return _mm_cvtss_f32(r1);
+        }
+        static inline float maxOf(const Reg x) {
+            const __m128 r4 = _mm_max_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+            const __m128 r2 = _mm_max_ps(r4, _mm_movehl_ps(r4, r4));
+            const __m128 r1 = _mm_max_ss(r2, _mm_shuffle_ps(r2, r2, 0x1));
+            return _mm_cvtss_f32(r1);
+        }
+        // Bit i is set if lane i is not zero
+        static inline int nonZero(const Reg x) {
+            return _mm256_movemask_ps(_mm256_cmp_ps(x, zero(), _CMP_NEQ_UQ));
+        }
+    };
+#endif
+
+#if defined(__SSE4_1__)
+    struct SSE41 {
+        using Reg = __m128;
+
+        static constexpr int WIDTH = 4;
+
+        static inline Reg zero() {
+            return _mm_setzero_ps();
+        }
+        static inline Reg set1(const float x) {
+            return _mm_set1_ps(x);
+        }
+        static inline Reg load(const float* p) {
+            return _mm_loadu_ps(p);
+        }
+        static inline Reg load(const uint16_t* p) {
+            const __m128i widened = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+            return _mm_castsi128_ps(_mm_slli_epi32(widened, 16));
+        }
+        static inline void store(float* p, const Reg x) {
+            _mm_storeu_ps(p, x);
+        }
+        static inline Reg add(const Reg a, const Reg b) {
+            return _mm_add_ps(a, b);
+        }
+        static inline Reg mul(const Reg a, const Reg b) {
+            return _mm_mul_ps(a, b);
+        }
+        static inline Reg fmadd(const Reg a, const Reg b, const Reg c) {
+            return _mm_add_ps(_mm_mul_ps(a, b), c);
+        }
+        static inline Reg sub(const Reg a, const Reg b) {
+            return _mm_sub_ps(a, b);
+        }
+        static inline Reg div(const Reg a, const Reg b) {
+            return _mm_div_ps(a, b);
+        }
+        static inline Reg sqrt(const Reg x) {
+            return _mm_sqrt_ps(x);
+        }
+        static inline Reg max(const Reg a, const Reg b) {
+            return _mm_max_ps(a, b);
+        }
+        static inline Reg abs(const Reg x) {
+            return _mm_andnot_ps(set1(-0.0f), x);
+        }
+        static inline Reg min(const Reg a, const Reg b) {
+            return _mm_min_ps(a, b);
+        }
+        static inline Reg ceil(const Reg x) {
+            return _mm_ceil_ps(x);
+        }
+        // |x| with the sign of s
+        static inline Reg withSign(const Reg x, const Reg s) {
+            return _mm_or_ps(x, _mm_and_ps(s, set1(-0.0f)));
+        }
+        // 1, -1 or 0
+        static inline Reg sign(const Reg x) {
+            return _mm_and_ps(_mm_cmpneq_ps(x, zero()), withSign(set1(1.0f), x));
+        }
+        // WIDTH 8 bit codes, stores round to nearest and saturate
+        static inline Reg loadInt8(const int8_t* p) {
+            int32_t codes;
+            std::memcpy(&codes, p, sizeof(codes));
+            return _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(codes)));
+        }
+        static inline Reg loadUint8(const uint8_t* p) {
+            int32_t codes;
+            std::memcpy(&codes, p, sizeof(codes));
+            return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(codes)));
+        }
+        static inline void storeInt8(int8_t* p, const Reg x) {
+            const __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(x), _mm_setzero_si128());
+            const int32_t codes = _mm_cvtsi128_si32(_mm_packs_epi16(words, words));
+            std::memcpy(p, &codes, sizeof(codes));
+        }
+        static inline void storeUint8(uint8_t* p, const Reg x) {
+            const __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(x), _mm_setzero_si128());
+            const int32_t codes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+            std::memcpy(p, &codes, sizeof(codes));
+        }
+        static inline Reg screlu(const Reg x) {
+            const Reg clipped = _mm_min_ps(_mm_max_ps(x, zero()), set1(1.0f));
+            return _mm_mul_ps(clipped, clipped);
+        }
+        static inline Reg screluPrime(const Reg x) {
+            const Reg inside = _mm_and_ps(_mm_cmpgt_ps(x, zero()), _mm_cmplt_ps(x, set1(1.0f)));
+            return _mm_blendv_ps(zero(), _mm_add_ps(x, x), inside);
+        }
+        static inline float sum(const Reg x) {
+            const __m128 r2 = _mm_add_ps(x, _mm_movehl_ps(x, x));
+            const __m128 r1 = _mm_add_ss(r2, _mm_shuffle_ps(r2, r2, 0x1));
+            return _mm_cvtss_f32(r1);
+        }
+        static inline float maxOf(const Reg x) {
+            const __m128 r2 = _mm_max_ps(x, _mm_movehl_ps(x, x));
+            const __m128 r1 = _mm_max_ss(r2, _mm_shuffle_ps(r2, r2, 0x1));
+            return _mm_cvtss_f32(r1);
+        }
+        // Bit i is set if lane i is not zero
+        static inline int nonZero(const Reg x) {
+            return _mm_movemask_ps(_mm_cmpneq_ps(x, zero()));
+        }
+    };
+#endif
+
+} // namespace
+} // namespace Kernels
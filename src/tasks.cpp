@@ -0,0 +1,280 @@
+#include "tasks.h"
+#include "types.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sched.h>
+#include <string>
+
+namespace Tasks {
+
+    static thread_local int currentWorker = 0;
+
+    // Failed attempts to find a task before wait() blocks until the group finishes or a task is pushed
+    constexpr int WAIT_SPINS = 64;
+
+    // CPUs of this process in the affinity mask, grouped by NUMA node. A host without
+    // /sys/devices/system/node is one node of every allowed CPU.
+    static std::vector<std::vector<int>> topology() {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            return {{}};
+        }
+
+        std::vector<std::vector<int>> nodes;
+        for (int node = 0;; ++node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) {
+                break;
+            }
+
+            // Ranges such as 0-15,32-47
+            std::vector<int> cpus;
+            std::string      range;
+            while (std::getline(file, range, ',')) {
+                const std::size_t dash  = range.find('-');
+                const int         first = std::stoi(range.substr(0, dash));
+                const int         last  = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    if (CPU_ISSET(cpu, &allowed)) {
+                        cpus.push_back(cpu);
+                    }
+                }
+            }
+            if (!cpus.empty()) {
+                nodes.push_back(std::move(cpus));
+            }
+        }
+
+        if (nodes.empty()) {
+            nodes.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    nodes[0].push_back(cpu);
+                }
+            }
+        }
+        return nodes;
+    }
+
+    int availableCpus() {
+        int cpus = 0;
+        for (const auto& node : topology()) {
+            cpus += int(node.size());
+        }
+        return std::max(1, cpus);
+    }
+
+    int numaNodes() {
+        return int(topology().size());
+    }
+
+    static void pin(std::thread::native_handle_type thread, const int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(thread, sizeof(set), &set);
+    }
+
+    Pool::Pool(const int threads) {
+        if (threads > MAX_THREADS) {
+            std::cout << "Note: " << threads << " threads requested, the pool is limited to " << MAX_THREADS << std::endl;
+        }
+
+        for (int i = 0; i < std::clamp(threads, 1, MAX_THREADS); ++i) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (int i = 1; i < size(); ++i) {
+            this->threads.emplace_back(&Pool::loop, this, i);
+        }
+
+        // Workers are split over the nodes in contiguous blocks and pinned round robin to their CPUs
+        const auto topology = Tasks::topology();
+
+        for (int i = 0; i < size() && topology.size() > 1; ++i) {
+            const int               node = int(std::size_t(i) * topology.size() / size());
+            const std::vector<int>& cpus = topology[node];
+            const int               rank = i - int((std::size_t(node) * size() + topology.size() - 1) / topology.size());
+
+            pin(i == 0 ? pthread_self() : this->threads[i - 1].native_handle(), cpus[rank % cpus.size()]);
+        }
+    }
+
+    Pool::~Pool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void Pool::push(Queue& queue, Task task, const bool pinned) {
+        task.group->pending.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            (pinned ? queue.pinned : queue.tasks).push_back(std::move(task));
+        }
+
+        // A worker going to sleep checks queued after announcing itself, so one of the two sees the other
+        queued.fetch_add(1);
+        pushed.fetch_add(1);
+        if (sleeping.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            if (pinned) {
+                wakeUp.notify_all();
+            } else {
+                wakeUp.notify_one();
+            }
+        }
+    }
+
+    void Pool::spawn(Group& group, std::function<void()> task) {
+        push(*queues[std::min(worker(), size() - 1)], Task{std::move(task), &group});
+    }
+
+    void Pool::spawnTo(const int worker, Group& group, std::function<void()> task) {
+        push(*queues[std::clamp(worker, 0, size() - 1)], Task{std::move(task), &group});
+    }
+
+    void Pool::background(Group& group, std::function<void()> task) {
+        push(backgroundQueue, Task{std::move(task), &group});
+    }
+
+    // Runs the own pinned tasks, pops from the back of the own deque, then steals from the front of
+    // the others. Background tasks are left to idle workers, a waiting thread only takes the ones of
+    // its own group.
+    bool Pool::tryRun(const int worker, const Group* waiting) {
+        Task task;
+        bool found = false;
+
+        for (int i = 0; i < size() && !found; ++i) {
+            Queue&                      queue = *queues[(worker + i) % size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+
+            if (i == 0 && !queue.pinned.empty()) {
+                task = std::move(queue.pinned.front());
+                queue.pinned.pop_front();
+            } else if (queue.tasks.empty()) {
+                continue;
+            } else if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            found = true;
+        }
+
+        if (!found) {
+            std::lock_guard<std::mutex> lock(backgroundQueue.mutex);
+
+            for (auto it = backgroundQueue.tasks.begin(); it != backgroundQueue.tasks.end(); ++it) {
+                if (waiting == nullptr || it->group == waiting) {
+                    task = std::move(*it);
+                    backgroundQueue.tasks.erase(it);
+                    found = true;
+                    break;
+                }
+            }
+        }
+
+        if (!found) {
+            return false;
+        }
+
+        queued.fetch_sub(1);
+        task.run();
+
+        // The last task of a group wakes the threads blocked in wait()
+        if (task.group->pending.fetch_sub(1) == 1 && sleeping.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            wakeUp.notify_all();
+        }
+        return true;
+    }
+
+    // Helps with the tasks it may run. Once none are left, say the remaining ones are pinned to
+    // other workers, it yields a few times and then sleeps until the group finishes or a task is pushed.
+    void Pool::wait(Group& group) {
+        const int self  = std::min(worker(), size() - 1);
+        int       spins = 0;
+
+        while (!group.done()) {
+            const unsigned seen = pushed.load();
+
+            if (tryRun(self, &group)) {
+                spins = 0;
+            } else if (++spins < WAIT_SPINS) {
+                std::this_thread::yield();
+            } else {
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                sleeping.fetch_add(1);
+                wakeUp.wait(lock, [&]() { return group.done() || pushed.load() != seen; });
+                sleeping.fetch_sub(1);
+                spins = 0;
+            }
+        }
+    }
+
+    void Pool::onEachWorker(const std::function<void(int)>& body) {
+        Group group;
+        for (int i = 0; i < size(); ++i) {
+            push(*queues[i], Task{[&body, i]() { body(i); }, &group}, true);
+        }
+        wait(group);
+    }
+
+    void Pool::loop(const int worker) {
+        currentWorker = worker;
+
+        while (!stopping.load()) {
+            if (tryRun(worker, nullptr)) {
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleeping.fetch_add(1);
+            wakeUp.wait(lock, [this]() { return stopping.load() || queued.load() > 0; });
+            sleeping.fetch_sub(1);
+        }
+    }
+
+    static std::unique_ptr<Pool>& instance() {
+        static std::unique_ptr<Pool> pool;
+        return pool;
+    }
+
+    void setThreads(const int threads) {
+        instance().reset();
+        instance() = std::make_unique<Pool>(threads > 0 ? threads : availableCpus());
+    }
+
+    Pool& pool() {
+        if (!instance()) {
+            setThreads(0);
+        }
+        return *instance();
+    }
+
+    int worker() {
+        return currentWorker;
+    }
+
+    void firstTouch(void* data, const std::size_t bytes) {
+        if (bytes == 0) {
+            return;
+        }
+
+        pool().onEachWorker([data, bytes](const int worker) {
+            const auto [first, last] = slice(worker, bytes);
+            std::memset(static_cast<char*>(data) + first, 0, last - first);
+        });
+    }
+
+} // namespace Tasks
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// The persistent task scheduler shared by the training, reduction, optimizer and data work.
+// Every worker owns a deque, pushes and pops its own tasks at the back and steals from the
+// front of the others once it runs dry. The threads live as long as the program, so a parallel
+// loop costs a few pushes instead of waking and joining a thread team, and independent loops
+// of one batch can be in flight at the same time.
+//
+// On hosts with several NUMA nodes the workers are pinned to the CPUs of the nodes in blocks,
+// so worker order is node order. Large buffers are first touched in worker slices (see slice()
+// and firstTouch()), which puts the pages of every slice on the node of the worker owning it.
+namespace Tasks {
+
+    // Counts the unfinished tasks spawned into it
+    class Group {
+    public:
+        Group() = default;
+
+        Group(const Group&)            = delete;
+        Group& operator=(const Group&) = delete;
+
+        bool done() const {
+            return pending.load() == 0;
+        }
+
+    private:
+        std::atomic<int> pending{0};
+
+        friend class Pool;
+    };
+
+    class Pool {
+    public:
+        // The thread creating the pool is worker 0, threads - 1 more are started
+        explicit Pool(int threads);
+        ~Pool();
+
+        int size() const {
+            return int(queues.size());
+        }
+
+        // Runs task on whichever worker gets to it first
+        void spawn(Group& group, std::function<void()> task);
+
+        // As spawn, queued on the given worker so it runs next to the memory that worker placed.
+        // Idle workers may still steal it.
+        void spawnTo(int worker, Group& group, std::function<void()> task);
+
+        // Long running tasks such as reading the next chunk. Only idle workers pick them up, and
+        // wait() only the ones of the group it waits for, so they never stall a batch.
+        void background(Group& group, std::function<void()> task);
+
+        // Runs tasks until every task of the group finished
+        void wait(Group& group);
+
+        // Runs body(worker) exactly once on every worker and waits for all of them
+        void onEachWorker(const std::function<void(int)>& body);
+
+        // Spawns body(first, last) over chunks of at most grain indices, without waiting
+        template<typename Body>
+        void parallelFor(Group& group, const int begin, const int end, const int grain, const Body& body) {
+            for (int first = begin; first < end; first += grain) {
+                const int last = std::min(first + grain, end);
+                spawn(group, [body, first, last]() { body(first, last); });
+            }
+        }
+
+        template<typename Body>
+        void parallelFor(const int begin, const int end, const int grain, const Body& body) {
+            Group group;
+            parallelFor(group, begin, end, grain, body);
+            wait(group);
+        }
+
+    private:
+        struct Task {
+            std::function<void()> run;
+            Group*                group;
+        };
+
+        struct Queue {
+            std::mutex       mutex;
+            std::deque<Task> tasks;
+            // Tasks only this worker may run
+            std::deque<Task> pinned;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        Queue                               backgroundQueue;
+        std::vector<std::thread>            threads;
+
+        // Tasks queued anywhere, idle workers sleep while it is zero
+        std::atomic<int>        queued{0};
+        // Tasks pushed so far, a blocked wait() retries once it changed
+        std::atomic<unsigned>   pushed{0};
+        std::atomic<int>        sleeping{0};
+        std::atomic<bool>       stopping{false};
+        std::mutex              sleepMutex;
+        std::condition_variable wakeUp;
+
+        void push(Queue& queue, Task task, bool pinned = false);
+        bool tryRun(int worker, const Group* waiting);
+        void loop(int worker);
+    };
+
+    // Replaces the pool with one of the given number of workers, 0 for every available CPU.
+    // Only call it while no task is running.
+    void setThreads(int threads);
+
+    // The pool every parallel loop of the trainer runs on
+    Pool& pool();
+
+    // Index of the calling worker in [0, threads()), stable for the life of the thread
+    int worker();
+
+    inline int threads() {
+        return pool().size();
+    }
+
+    // CPUs this process may run on and the NUMA nodes they belong to
+    int availableCpus();
+    int numaNodes();
+
+    // The part [first, last) of count items worker owns, contiguous and in worker order
+    inline std::pair<std::size_t, std::size_t> slice(const int worker, const std::size_t count) {
+        const std::size_t workers = std::size_t(threads());
+        return {count * worker / workers, count * (worker + 1) / workers};
+    }
+
+    // Inverse of slice(), the worker owning item index of count items
+    inline int owner(const std::size_t index, const std::size_t count) {
+        const std::size_t workers = std::size_t(threads());
+        return int(((index + 1) * workers + count - 1) / count) - 1;
+    }
+
+    // Zeroes bytes of a buffer no thread touched yet, each worker its own slice
+    void firstTouch(void* data, std::size_t bytes);
+
+} // namespace Tasks
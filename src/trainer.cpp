@@ -1,10 +1,16 @@
 #include "trainer.h"
+#include "kernels.h"
 #include "nn.h"
 #include "optimizer.h"
-#include <omp.h>
+#include "tasks.h"
+#include <atomic>
 
 #define EPOCH_ERROR epochError / static_cast<double>(batchSize * batchIterations)
 
+// Samples per task of the batch loops and touched rows per task of the optimizer
+constexpr int SAMPLE_GRAIN = 64;
+constexpr int ROW_GRAIN    = 16;
+
 inline float expectedEval(float eval, float wdl, float lambda) {
     return lambda * sigmoid(eval) + (1 - lambda) * wdl;
 }
@@ -14,137 +20,400 @@ inline float errorGradient(float output, float eval, float wdl) {
     return 2 * (sigmoid(output) - expected);
 }
 
-inline float errorFunction(float output, float expected) {
-    return pow(sigmoid(output) - expected, 2);
+void Trainer::batch() {
+    const Kernels::Table& kernels = Kernels::active();
+
+    const bool batched  = forwardMode == ForwardMode::Batched;
+    const bool rowOwner = backwardMode == BackwardMode::RowOwner;
+
+    if (batched) {
+        nn.forwardBatch(batchAccumulators.data(), dataSetLoader.loadBatchFeatures());
+    }
+
+    if (rowOwner) {
+        for (auto& contributions : rowContributions) {
+            contributions.clear();
+        }
+    }
+
+    Tasks::pool().parallelFor(0, dataSetLoader.m_batchSize, SAMPLE_GRAIN, [&](const int first, const int last) {
+        const int threadId = Tasks::worker();
+
+        for (int batchIdx = first; batchIdx < last; batchIdx++) {
+            // The rows of a later sample of this task load while the current one is computed. Batched
+            // mode already read the weights, row owner mode writes no gradient rows here.
+            if (prefetchDistance > 0 && batchIdx + prefetchDistance < last) {
+                const Features& ahead = dataSetLoader.getEntry(batchIdx + prefetchDistance).extractFeatures();
+                if (!batched) {
+                    Kernels::prefetchWeights(nn, ahead);
+                }
+                if (!rowOwner) {
+                    Kernels::prefetchGradients(currentGradients()[threadId], ahead);
+                }
+            }
+
+            // Load the current batch entry
+            DataLoader::DataSetEntry& entry = dataSetLoader.getEntry(batchIdx);
+
+            alignas(32) NN::Accumulator localAccumulator;
+            alignas(32) NN::Accumulator activated;
+            NN::Color                   stm        = NN::Color(entry.sideToMove());
+            const Features&             featureset = entry.extractFeatures();
+
+            const float eval     = entry.score();
+            const float wdl      = entry.wdl();
+            const float lambda   = getLambda();
+            const float expected = expectedEval(eval, wdl, lambda);
+
+            BatchGradients& gradients = currentGradients()[threadId];
+
+            // The default modes run the whole sample through the fused kernel
+            if (!batched && !rowOwner) {
+                float loss;
+                Kernels::fusedStep(nn, featureset, stm, expected, gradients, loss);
+                losses[threadId] += loss;
+                continue;
+            }
+
+            //--- Forward Pass ---//
+            float*      accumulator = batched ? batchAccumulators.data() + std::size_t(batchIdx) * HIDDEN_SIZE * 2 : localAccumulator.data();
+            const float output      = batched ? nn.forwardOutput(accumulator, activated.data()) : nn.forward(localAccumulator, activated, featureset, stm);
+
+            losses[threadId] += errorFunction(output, expected);
+
+            //--- Backward Pass ---//
+            const float outGradient = errorGradient(output, expected) * sigmoidPrime(output);
+
+            // In row owner mode the hidden losses are kept until the owners scatter them
+            alignas(32) std::array<float, HIDDEN_SIZE * 2> localHiddenLosses;
+            float* hiddenLosses = rowOwner ? hiddenLossData() + std::size_t(batchIdx) * HIDDEN_SIZE * 2 : localHiddenLosses.data();
+
+            // Hidden bias, hidden features and input bias
+            kernels.backward(Kernels::view(nn), accumulator, activated.data(), outGradient, Kernels::view(gradients), hiddenLosses);
+
+            // Input features
+            if (rowOwner) {
+                std::vector<RowContribution>* contributions = &rowContributions[threadId * threadCount];
+
+                for (int i = 0; i < featureset.n; ++i) {
+                    int f1 = featureset.features[i][stm];
+                    int f2 = featureset.features[i][!stm];
+
+                    contributions[rowOwnerOf(f1)].push_back({f1, batchIdx * 2});
+                    contributions[rowOwnerOf(f2)].push_back({f2, batchIdx * 2 + 1});
+                }
+                continue;
+            }
+
+            for (int i = 0; i < featureset.n; ++i) {
+                int f1 = featureset.features[i][stm];
+                int f2 = featureset.features[i][!stm];
+
+                gradients.touchRow(f1);
+                gradients.touchRow(f2);
+
+                kernels.addRow(gradients.inputFeatures.data() + f1 * HIDDEN_SIZE, hiddenLosses);
+                kernels.addRow(gradients.inputFeatures.data() + f2 * HIDDEN_SIZE, hiddenLosses + HIDDEN_SIZE);
+            }
+        }
+    });
+
+    if (rowOwner) {
+        scatterOwnedRows();
+    }
 }
 
-inline float errorGradient(float output, float expected) {
-    return 2 * (sigmoid(output) - expected);
+void Trainer::hogwildBatch() {
+    std::visit([this](auto& selected) { hogwildBatch(selected); }, optimizer);
 }
 
-void Trainer::batch(std::array<uint8_t, INPUT_SIZE>& active) {
-    std::array<std::array<uint8_t, INPUT_SIZE>, THREADS> actives;
-    std::memset(actives.data(), 0, sizeof(actives));
-#pragma omp parallel for schedule(static) num_threads(THREADS)
-    for (int batchIdx = 0; batchIdx < dataSetLoader.m_batchSize; batchIdx++) {
-        const int threadId = omp_get_thread_num();
+// Threads pull positions and every sample is its own optimizer step on the input rows it used. Weights
+// and optimizer state are shared without locks, concurrent updates of a row may interleave.
+// The step counter is shared atomically, so the lazy catch-up of untouched rows stays exact.
+// Every sample touches all of the dense layers, updating them per sample would make them a hot
+// spot of every thread, so their gradients are summed per thread and applied once per batch.
+template<typename Opt>
+void Trainer::hogwildBatch(Opt& optimizer) {
+    const bool packed = nn.isPacked();
 
-        // Load the current batch entry
-        DataLoader::DataSetEntry& entry = dataSetLoader.getEntry(batchIdx);
+    Tasks::pool().parallelFor(0, dataSetLoader.m_batchSize, SAMPLE_GRAIN, [&](const int first, const int last) {
+        const int threadId = Tasks::worker();
 
-        alignas(32) NN::Accumulator accumulator;
-        alignas(32) NN::Accumulator activated;
-        NN::Color                   stm        = NN::Color(entry.sideToMove());
-        const Features&             featureset = entry.extractFeatures();
+        for (int batchIdx = first; batchIdx < last; batchIdx++) {
+            DataLoader::DataSetEntry& entry = dataSetLoader.getEntry(batchIdx);
 
-        const float eval     = entry.score();
-        const float wdl      = entry.wdl();
-        const float lambda   = getLambda();
-        const float expected = expectedEval(eval, wdl, lambda);
+            alignas(64) NN::Accumulator accumulator;
+            alignas(64) NN::Accumulator activated;
+            NN::Color                   stm        = NN::Color(entry.sideToMove());
+            const Features&             featureset = entry.extractFeatures();
 
-        //--- Forward Pass ---//
-        const float output = nn.forward(accumulator, activated, featureset, stm);
+            const float expected = expectedEval(entry.score(), entry.wdl(), getLambda());
 
-        losses[threadId] += errorFunction(output, expected);
+            //--- Forward Pass ---//
+            const float output = nn.forward(accumulator, activated, featureset, stm);
 
-        //--- Backward Pass ---//
-        BatchGradients& gradients   = batchGradients[threadId];
-        const float     outGradient = errorGradient(output, expected) * sigmoidPrime(output);
+            losses[threadId] += errorFunction(output, expected);
 
-        // Hidden bias
-        gradients.hiddenBias[0] += outGradient;
+            //--- Backward Pass ---//
+            const float outGradient = errorGradient(output, expected) * sigmoidPrime(output);
 
-        // Hidden features
-#pragma omp simd
-        for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
-            gradients.hiddenFeatures[i] += outGradient * activated[i];
-        }
+            DenseGradients& dense = denseGradients[threadId];
 
-        std::array<float, HIDDEN_SIZE * 2> hiddenLosses;
+            alignas(64) std::array<float, HIDDEN_SIZE * 2> hiddenLosses;
 
-#pragma omp simd
-        for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
-            hiddenLosses[i] = outGradient * nn.hiddenFeatures[i] * SCReLUPrime(accumulator[i]);
-        }
+            for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
+                dense.hiddenFeatures[i] += outGradient * activated[i];
+                hiddenLosses[i] = outGradient * nn.hiddenFeatures[i] * SCReLUPrime(accumulator[i]);
+            }
+            for (int i = 0; i < HIDDEN_SIZE; ++i) {
+                dense.inputBias[i] += hiddenLosses[i] + hiddenLosses[i + HIDDEN_SIZE];
+            }
+            dense.hiddenBias += outGradient;
 
-        // Input bias
-#pragma omp simd
-        for (int i = 0; i < HIDDEN_SIZE; ++i) {
-            gradients.inputBias[i] += hiddenLosses[i] + hiddenLosses[i + HIDDEN_SIZE];
-        }
+            const std::int64_t step = std::atomic_ref<std::int64_t>(optimizer.steps).fetch_add(1) + 1;
+
+            // Input features
+            for (int i = 0; i < featureset.n; ++i) {
+                for (int half = 0; half < 2; ++half) {
+                    const int row = featureset.features[i][half == 0 ? stm : !stm];
 
-        // Input features
-        for (int i = 0; i < featureset.n; ++i) {
-            int f1 = featureset.features[i][stm];
-            int f2 = featureset.features[i][!stm];
+                    catchUpRow(optimizer, row, step - 1 - nnGradients.advanceRow(row, step));
 
-            actives[threadId][f1] = 1;
-            actives[threadId][f2] = 1;
+                    const float* gradient = hiddenLosses.data() + half * HIDDEN_SIZE;
+                    optimizeParameters(optimizer, Parameters::INPUT_FEATURES + std::size_t(row) * HIDDEN_SIZE, &gradient, 1, HIDDEN_SIZE);
 
-#pragma omp simd
-            for (int j = 0; j < HIDDEN_SIZE; ++j) {
-                gradients.inputFeatures[f1 * HIDDEN_SIZE + j] += hiddenLosses[j];
-                gradients.inputFeatures[f2 * HIDDEN_SIZE + j] += hiddenLosses[j + HIDDEN_SIZE];
+                    if (packed) {
+                        nn.packRow(row);
+                    }
+                }
             }
         }
+    });
+
+    // Input bias, hidden features and hidden bias
+    std::array<const float*, MAX_THREADS> inputBiasGradients;
+    std::array<const float*, MAX_THREADS> hiddenFeatureGradients;
+    float                                 hiddenBiasGradient = 0;
+    for (int k = 0; k < threadCount; ++k) {
+        inputBiasGradients[k]     = denseGradients[k].inputBias.data();
+        hiddenFeatureGradients[k] = denseGradients[k].hiddenFeatures.data();
+        hiddenBiasGradient += denseGradients[k].hiddenBias;
+    }
+
+    optimizeParameters(optimizer, Parameters::INPUT_BIAS, inputBiasGradients.data(), threadCount, HIDDEN_SIZE);
+    optimizeParameters(optimizer, Parameters::HIDDEN_FEATURES, hiddenFeatureGradients.data(), threadCount, HIDDEN_SIZE * 2);
+    optimizeHiddenBias(optimizer, hiddenBiasGradient);
+
+    for (DenseGradients& dense : denseGradients) {
+        dense.clear();
+    }
+}
+
+// Union of the rows touched by any thread since the gradients were cleared, in row order so the
+// rows of one optimizer task share the worker that placed them
+void Trainer::collectTouchedRows() {
+    std::array<uint8_t, INPUT_SIZE> active{};
+    for (int threadId = 0; threadId < threadCount; ++threadId) {
+        for (const int row : currentGradients()[threadId].touchedRows) {
+            active[row] = 1;
+        }
     }
 
-#pragma for schedule(static) num_threads(THREADS)
-    for (int i = 0; i < INPUT_SIZE; ++i) {
-        for (int j = 0; j < THREADS; ++j) {
-            active[i] |= actives[j][i];
+    touchedRows.clear();
+    for (int row = 0; row < INPUT_SIZE; ++row) {
+        if (active[row]) {
+            touchedRows.push_back(row);
         }
     }
 }
 
-void        Trainer::applyGradients(std::array<uint8_t, INPUT_SIZE>& actives) {
-#pragma omp parallel for schedule(static) num_threads(THREADS)
-    for (int i = 0; i < INPUT_SIZE; ++i) {
-        if (!actives[i])
-            continue;
+void Trainer::scatterOwnedRows() {
+    const Kernels::Table& kernels      = Kernels::active();
+    const float*          hiddenLosses = hiddenLossData();
+
+    // Every row is written by exactly one thread, so applyGradients never has to reduce across threads
+    Tasks::pool().parallelFor(0, threadCount, 1, [&](const int owner, const int) {
+        BatchGradients& gradients = currentGradients()[owner];
+
+        for (int threadId = 0; threadId < threadCount; ++threadId) {
+            for (const RowContribution& contribution : rowContributions[threadId * threadCount + owner]) {
+                gradients.touchRow(contribution.row);
+
+                kernels.addRow(gradients.inputFeatures.data() + contribution.row * HIDDEN_SIZE, hiddenLosses + std::size_t(contribution.half) * HIDDEN_SIZE);
+            }
+        }
+    });
+}
+
+void        Trainer::applyGradients(Tasks::Group& tail) {
+    std::visit([this, &tail](auto& selected) { applyGradients(selected, tail); }, optimizer);
+}
+
+// The touched rows, the dense layers and the weight independent head of the next batch are spawned
+// as tasks into tail, so the tail of a step is one graph instead of a chain of barriers. Every task
+// clears the gradients it consumed, which leaves nothing for clearGradientsAndLosses. The tasks only
+// capture values, in pipelined mode they keep running while the next batch is computed.
+template<typename Opt>
+void Trainer::applyGradients(Opt& optimizer, Tasks::Group& tail) {
+    const bool packed = nn.isPacked();
+
+    optimizer.step();
+    const std::int64_t step = optimizer.steps;
+
+    BatchGradients* gradients = currentGradients();
+    Tasks::Pool&    pool      = Tasks::pool();
+
+    const auto updateRows = [this, &optimizer, gradients, step, packed](const int first, const int last) {
+        for (int r = first; r < last; ++r) {
+            const int row = touchedRows[r];
+
+            // Only reduce over the threads that actually wrote this row
+            std::array<const float*, MAX_THREADS> rowGradients;
+            int                                   count = 0;
+            for (int k = 0; k < threadCount; ++k) {
+                if (gradients[k].rowTouched[row]) {
+                    rowGradients[count++] = gradients[k].inputFeatures.data() + row * HIDDEN_SIZE;
+                }
+            }
+
+            // Steps this row missed since it was last touched
+            catchUpRow(optimizer, row, step - 1 - nnGradients.advanceRow(row, step));
 
-        for (int j = 0; j < HIDDEN_SIZE; ++j) {
-            int   index       = i * HIDDEN_SIZE + j;
-            float gradientSum = 0;
+            optimizeParameters(optimizer, Parameters::INPUT_FEATURES + std::size_t(row) * HIDDEN_SIZE, rowGradients.data(), count, HIDDEN_SIZE);
 
-            for (int k = 0; k < THREADS; ++k) {
-                gradientSum += batchGradients[k].inputFeatures[index];
+            if (packed) {
+                nn.packRow(row);
             }
 
-            optimizer.update(nn.inputFeatures[index], nnGradients.inputFeatures[index], gradientSum, learningRate);
+            for (int k = 0; k < threadCount; ++k) {
+                if (gradients[k].rowTouched[row]) {
+                    gradients[k].clearRow(row);
+                }
+            }
         }
+    };
+
+    // Each chunk of rows is queued on the worker whose slice of the weights and state it falls in
+    for (int first = 0; first < int(touchedRows.size()); first += ROW_GRAIN) {
+        const int last = std::min(first + ROW_GRAIN, int(touchedRows.size()));
+        pool.spawnTo(Tasks::owner(touchedRows[first], INPUT_SIZE), tail, [updateRows, first, last]() { updateRows(first, last); });
     }
 
-#pragma omp parallel for schedule(static) num_threads(THREADS)
-    for (int i = 0; i < HIDDEN_SIZE; ++i) {
-        float gradientSum = 0;
+    // Input bias, hidden features and hidden bias
+    pool.spawn(tail, [this, &optimizer, gradients]() {
+        std::array<const float*, MAX_THREADS> inputBiasGradients;
+        std::array<const float*, MAX_THREADS> hiddenFeatureGradients;
+        for (int j = 0; j < threadCount; ++j) {
+            inputBiasGradients[j]     = gradients[j].inputBias.data();
+            hiddenFeatureGradients[j] = gradients[j].hiddenFeatures.data();
+        }
+
+        float hiddenBiasGradient = 0;
+        for (int i = 0; i < threadCount; ++i) {
+            hiddenBiasGradient += gradients[i].hiddenBias[0];
+        }
+
+        optimizeParameters(optimizer, Parameters::INPUT_BIAS, inputBiasGradients.data(), threadCount, HIDDEN_SIZE);
+        optimizeParameters(optimizer, Parameters::HIDDEN_FEATURES, hiddenFeatureGradients.data(), threadCount, HIDDEN_SIZE * 2);
+        optimizeHiddenBias(optimizer, hiddenBiasGradient);
 
-        for (int j = 0; j < THREADS; ++j) {
-            gradientSum += batchGradients[j].inputBias[i];
+        // The row tasks only read the touched flags, the lists can go now
+        for (int k = 0; k < threadCount; ++k) {
+            gradients[k].clearDense();
+            gradients[k].touchedRows.clear();
         }
+    });
+
+    // The next batch is already loaded and its CSR view does not read the weights. A pipelined
+    // step overlaps the next batch itself, which builds the view on its own.
+    if (forwardMode == ForwardMode::Batched && updateMode != UpdateMode::Pipelined) {
+        pool.spawn(tail, [this]() { dataSetLoader.loadBatchFeatures(); });
+    }
+}
 
-        optimizer.update(nn.inputBias[i], nnGradients.inputBias[i], gradientSum, learningRate);
+// One optimizer step of size parameters at offset in the parameter layout, summing count gradients.
+// The weights and both moments share the offset, only 8 bit input feature moments are kept apart.
+template<typename Opt>
+void Trainer::optimizeParameters(const Opt& optimizer, const std::size_t offset, const float* const* gradients, const int count, const int size) {
+    float* weights = nn.parameters.data() + offset;
+
+    if constexpr (Optimizer::MOMENTUM_ONLY<Opt>) {
+        Kernels::optimizeRow(optimizer, weights, nnGradients.m(offset), gradients, count, size, learningRate);
+    } else if (offset < Parameters::INPUT_BIAS && nnGradients.layout() == StateLayout::QuantizedMoments) {
+        Kernels::optimizeRow(optimizer, weights, nnGradients.inputFeatureBlocks.data() + offset / MOMENT_BLOCK, gradients, count, size, learningRate);
+    } else {
+        Kernels::optimizeRow(optimizer, weights, nnGradients.m(offset), nnGradients.v(offset), gradients, count, size, learningRate);
     }
+}
 
-    // --- Hidden Features ---//
-#pragma omp parallel for schedule(static) num_threads(THREADS)
-    for (int i = 0; i < HIDDEN_SIZE * 2; ++i) {
-        float gradientSum = 0;
+// The single hidden bias is below the width of the row kernels
+template<typename Opt>
+void Trainer::optimizeHiddenBias(const Opt& optimizer, const float gradient) {
+    float& weight = nn.parameters[Parameters::HIDDEN_BIAS];
 
-        for (int j = 0; j < THREADS; ++j) {
-            gradientSum += batchGradients[j].hiddenFeatures[i];
-        }
+    if constexpr (Optimizer::MOMENTUM_ONLY<Opt>) {
+        optimizer.update(weight, *nnGradients.m(Parameters::HIDDEN_BIAS), gradient, learningRate);
+    } else {
+        optimizer.update(weight, *nnGradients.m(Parameters::HIDDEN_BIAS), *nnGradients.v(Parameters::HIDDEN_BIAS), gradient, learningRate);
+    }
+}
 
-        optimizer.update(nn.hiddenFeatures[i], nnGradients.hiddenFeatures[i], gradientSum, learningRate);
+// Applies the optimizer steps an input row missed, 8 bit moments are decoded around it
+template<typename Opt>
+void Trainer::catchUpRow(const Opt& optimizer, const int row, const std::int64_t skipped) {
+    if (skipped <= 0) {
+        return;
     }
 
-    //-- Hidden Bias --//
-    float gradientSum = 0;
-    for (int i = 0; i < THREADS; ++i) {
-        gradientSum += batchGradients[i].hiddenBias[0];
+    const std::size_t offset  = Parameters::INPUT_FEATURES + std::size_t(row) * HIDDEN_SIZE;
+    float*            weights = nn.parameters.data() + offset;
+    const auto        decay   = optimizer.decay(skipped, learningRate);
+
+    if constexpr (Optimizer::MOMENTUM_ONLY<Opt>) {
+        Kernels::catchUpRow(optimizer, weights, nnGradients.m(offset), HIDDEN_SIZE, decay);
+    } else if (nnGradients.layout() == StateLayout::Moments) {
+        Kernels::catchUpRow(optimizer, weights, nnGradients.m(offset), nnGradients.v(offset), HIDDEN_SIZE, decay);
+    } else {
+        MomentBlock* blocks = nnGradients.inputFeatureBlocks.data() + offset / MOMENT_BLOCK;
+
+        alignas(64) std::array<float, HIDDEN_SIZE> m;
+        alignas(64) std::array<float, HIDDEN_SIZE> v;
+        for (int b = 0; b < HIDDEN_SIZE / MOMENT_BLOCK; ++b) {
+            blocks[b].decode(m.data() + b * MOMENT_BLOCK, v.data() + b * MOMENT_BLOCK);
+        }
+
+        Kernels::catchUpRow(optimizer, weights, m.data(), v.data(), HIDDEN_SIZE, decay);
+
+        for (int b = 0; b < HIDDEN_SIZE / MOMENT_BLOCK; ++b) {
+            blocks[b].encode(m.data() + b * MOMENT_BLOCK, v.data() + b * MOMENT_BLOCK);
+        }
     }
+}
+
+// Brings every input row up to the current step, so the weights match a dense optimizer before they are read
+void Trainer::catchUpRows() {
+    std::visit([this](const auto& selected) { catchUpRows(selected); }, optimizer);
+}
+
+template<typename Opt>
+void Trainer::catchUpRows(const Opt& optimizer) {
+    const std::int64_t step   = optimizer.steps;
+    const bool         packed = nn.isPacked();
+
+    Tasks::pool().parallelFor(0, INPUT_SIZE, ROW_GRAIN, [&](const int first, const int last) {
+        for (int row = first; row < last; ++row) {
+            const std::int64_t skipped = step - nnGradients.advanceRow(row, step);
+            if (skipped <= 0) {
+                continue;
+            }
+
+            catchUpRow(optimizer, row, skipped);
 
-    optimizer.update(nn.hiddenBias[0], nnGradients.hiddenBias[0], gradientSum, learningRate);
+            if (packed) {
+                nn.packRow(row);
+            }
+        }
+    });
 }
 
 void Trainer::train() {
@@ -152,48 +421,35 @@ void Trainer::train() {
     lossFile << "epoch,train_error,val_error,learning_rate" << std::endl;
 
     const std::size_t batchSize = dataSetLoader.m_batchSize;
+    const std::size_t stepSize  = batchSize * accumulationSteps;
+    const int         batches   = int(EPOCH_SIZE / stepSize);
 
     for (currentEpoch = 1; currentEpoch <= maxEpochs; ++currentEpoch) {
         std::uint64_t start           = Misc::getTimeMs();
         std::size_t   batchIterations = 0;
         double        epochError      = 0.0;
 
-        for (int b = 0; b < EPOCH_SIZE / batchSize; ++b) {
-            batchIterations++;
-            double batchError = 0;
-
-            // Clear gradients and losses
-            clearGradientsAndLosses();
-
-            std::array<uint8_t, INPUT_SIZE> actives;
-
-            // Perform batch operations
-            batch(actives);
-
-            // Calculate batch error
-            for (int threadId = 0; threadId < THREADS; ++threadId) {
-                batchError += static_cast<double>(losses[threadId]);
-            }
+        for (int b = 0; b < batches; ++b) {
+            const double batchError = step();
 
             // Accumulate epoch error
+            batchIterations += accumulationSteps;
             epochError += batchError;
 
-            // Gradient descent
-            applyGradients(actives);
-
-            // Load the next batch
-            dataSetLoader.loadNextBatch();
-
             // Print progress
-            if (b % 100 == 0 || b == EPOCH_SIZE / batchSize - 1) {
+            if (b % 100 == 0 || b == batches - 1) {
                 std::uint64_t end            = Misc::getTimeMs();
-                int           positionsCount = (b + 1) * batchSize;
+                int           positionsCount = (b + 1) * stepSize;
                 int           posPerSec      = static_cast<int>(positionsCount / ((end - start) / 1000.0));
-                printf("\rep/ba:[%4d/%4d] |batch error:[%1.9f]|epoch error:[%1.9f]|speed:[%9d] pos/s", currentEpoch, b, batchError / static_cast<double>(batchSize), EPOCH_ERROR, posPerSec);
+                printf("\rep/ba:[%4d/%4d] |batch error:[%1.9f]|epoch error:[%1.9f]|speed:[%9d] pos/s", currentEpoch, b, batchError / static_cast<double>(stepSize), EPOCH_ERROR, posPerSec);
                 std::cout << std::flush;
             }
         }
 
+        // Untouched rows are behind, catch them up before saving and validating
+        Tasks::pool().wait(optimizerTail);
+        catchUpRows();
+
         // Save the network
         if (currentEpoch % saveInterval == 0) {
             save(std::to_string(currentEpoch));
@@ -202,62 +458,117 @@ void Trainer::train() {
         // Decay learning rate
         lrScheduler.step(learningRate);
 
+        const QuantizationError quantized = quantizationError();
+
         double valError = validate();
         std::cout << std::endl;
         printf("epoch: [%5d/%5d] | val error: [%11.9f] | epoch error: [%11.9f]", currentEpoch, maxEpochs, valError, EPOCH_ERROR);
         std::cout << std::endl;
+        printf("quantized %s: [%7zu positions] | mean error: [%8.3f] cp | max error: [%8.3f] cp", nn.isInt8() ? "int8" : "int16", quantized.positions, quantized.mean(), quantized.max);
+        std::cout << std::endl;
+
+        // Hogwild samples update the weights directly and count nothing
+        const Sparsity sparsity = takeSparsity();
+        if (sparsity.values > 0) {
+            printf("backward sparsity: zero hidden losses [%5.1f%%] | skipped blocks [%5.1f%%]", 100.0 * sparsity.zeroValues / sparsity.values, 100.0 * sparsity.skippedBlocks / sparsity.blocks);
+            std::cout << std::endl;
+        }
 
         // Save the loss
         lossFile << currentEpoch << "," << EPOCH_ERROR << "," << valError << "," << learningRate << std::endl;
     }
 }
 
+double Trainer::step() {
+    const bool hogwild    = updateMode == UpdateMode::Hogwild;
+    const bool pipelined  = updateMode == UpdateMode::Pipelined;
+    double     batchError = 0;
+
+    // Clear gradients and losses
+    clearGradientsAndLosses();
+
+    // Accumulate the gradients of all micro-batches, each one loaded after the previous finished
+    for (int microBatch = 0; microBatch < accumulationSteps; ++microBatch) {
+        if (hogwild) {
+            hogwildBatch();
+        } else {
+            batch();
+        }
+
+        dataSetLoader.loadNextBatch();
+    }
+
+    // Calculate batch error
+    for (int threadId = 0; threadId < threadCount; ++threadId) {
+        batchError += static_cast<double>(losses[threadId]);
+    }
+
+    // Gradient descent, once for all micro-batches. Hogwild samples already applied their own.
+    // A pipelined step is only waited for here, after the next batch ran on stale weights.
+    if (!hogwild) {
+        Tasks::pool().wait(optimizerTail);
+
+        collectTouchedRows();
+        applyGradients(optimizerTail);
+
+        if (pipelined) {
+            gradientSet ^= 1;
+        } else {
+            Tasks::pool().wait(optimizerTail);
+        }
+    }
+
+    return batchError;
+}
+
 void Trainer::clearGradientsAndLosses() {
-    for (auto& grad : batchGradients) {
-        grad.clear();
+    // applyGradients clears what it consumed, this only finds rows no step consumed. The other
+    // set of pipelined mode may still be read by the optimizer and is left alone.
+    for (int threadId = 0; threadId < threadCount && !batchGradients.empty(); ++threadId) {
+        currentGradients()[threadId].clear();
     }
-    memset(losses.data(), 0, sizeof(float) * THREADS);
+    memset(losses.data(), 0, sizeof(float) * losses.size());
 }
 
 void        Trainer::validationBatch(std::vector<float>& validationLosses) {
-#pragma omp parallel for schedule(static) num_threads(THREADS)
-    for (int batchIdx = 0; batchIdx < valDataSetLoader.m_batchSize; batchIdx++) {
-        const int threadId = omp_get_thread_num();
+    Tasks::pool().parallelFor(0, valDataSetLoader.m_batchSize, SAMPLE_GRAIN, [&](const int first, const int last) {
+        const int threadId = Tasks::worker();
 
-        // Load the current batch entry
-        DataLoader::DataSetEntry& entry = valDataSetLoader.getEntry(batchIdx);
+        for (int batchIdx = first; batchIdx < last; batchIdx++) {
+            // Load the current batch entry
+            DataLoader::DataSetEntry& entry = valDataSetLoader.getEntry(batchIdx);
 
-        alignas(32) NN::Accumulator accumulator;
-        alignas(32) NN::Accumulator activated;
-        NN::Color                   stm        = NN::Color(entry.sideToMove());
-        const Features&             featureset = entry.extractFeatures();
+            alignas(32) NN::Accumulator accumulator;
+            alignas(32) NN::Accumulator activated;
+            NN::Color                   stm        = NN::Color(entry.sideToMove());
+            const Features&             featureset = entry.extractFeatures();
 
-        const auto eval = entry.score();
-        const auto wdl  = entry.wdl();
+            const auto eval = entry.score();
+            const auto wdl  = entry.wdl();
 
-        //--- Forward Pass ---//
-        const float output = nn.forward(accumulator, activated, featureset, stm);
+            //--- Forward Pass ---//
+            const float output = nn.forward(accumulator, activated, featureset, stm);
 
-        validationLosses[threadId] += errorFunction(output, eval, wdl);
-    }
+            validationLosses[threadId] += errorFunction(output, eval, wdl);
+        }
+    });
 }
 
 double Trainer::validate() {
     std::size_t batchIterations = 0;
     double      epochError      = 0.0;
 
-    for (int b = 0; b < VAL_EPOCH_SIZE / valDataSetLoader.m_batchSize; ++b) {
+    for (std::size_t b = 0; b < VAL_EPOCH_SIZE / valDataSetLoader.m_batchSize; ++b) {
         batchIterations++;
         double batchError = 0;
 
         std::vector<float> validationLosses;
-        validationLosses.resize(THREADS);
-        std::memset(validationLosses.data(), 0, sizeof(validationLosses));
+        validationLosses.resize(threadCount);
 
         validationBatch(validationLosses);
 
         // Calculate batch error
-        for (int threadId = 0; threadId < THREADS; ++threadId) {
+        for (int threadId = 0; threadId < threadCount; ++threadId) {
             batchError += static_cast<double>(validationLosses[threadId]);
         }
 
@@ -269,4 +580,52 @@ double Trainer::validate() {
     }
 
     return epochError / static_cast<double>(valDataSetLoader.m_batchSize * batchIterations);
+}
+
+template<typename InputType>
+static QuantizationError quantizationError(const NN& nn, DataLoader::DataSetLoader& loader, const int threadCount) {
+    const auto quantized = std::make_unique<QuantizedNN<InputType>>(nn);
+
+    std::vector<QuantizationError> errors(threadCount);
+
+    Tasks::pool().parallelFor(0, loader.m_batchSize, SAMPLE_GRAIN, [&](const int first, const int last) {
+        QuantizationError& error = errors[Tasks::worker()];
+
+        for (int batchIdx = first; batchIdx < last; batchIdx++) {
+            DataLoader::DataSetEntry& entry = loader.getEntry(batchIdx);
+
+            alignas(32) NN::Accumulator                  accumulator;
+            alignas(32) NN::Accumulator                  activated;
+            typename QuantizedNN<InputType>::Accumulator quantizedAccumulator;
+            const NN::Color                              stm        = NN::Color(entry.sideToMove());
+            const Features&                              featureset = entry.extractFeatures();
+
+            const float   output = nn.forward(accumulator, activated, featureset, stm);
+            const int32_t eval   = quantized->evaluate(quantizedAccumulator, featureset, stm);
+
+            error.add(std::abs(eval - double(output) * EVAL_SCALE));
+        }
+    });
+
+    QuantizationError total;
+    for (const QuantizationError& error : errors) {
+        total.merge(error);
+    }
+    return total;
+}
+
+Sparsity Trainer::takeSparsity() {
+    Sparsity total;
+    for (BatchGradients& gradients : batchGradients) {
+        total.merge(gradients.sparsity);
+        gradients.sparsity = Sparsity{};
+    }
+    return total;
+}
+
+QuantizationError Trainer::quantizationError() {
+    if (nn.isInt8()) {
+        return ::quantizationError<int8_t>(nn, valDataSetLoader, threadCount);
+    }
+    return ::quantizationError<int16_t>(nn, valDataSetLoader, threadCount);
 }
\ No newline at end of file
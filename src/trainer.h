@@ -2,15 +2,65 @@
 
 #include "dataloader.h"
 #include "lrscheduler.h"
+#include "memory.h"
 #include "misc.h"
 #include "nn.h"
 #include "optimizer.h"
+#include "quantize.h"
+#include "tasks.h"
 #include "types.h"
 #include <filesystem>
 #include <type_traits>
 #include <vector>
 
-class Trainer {
+enum class BackwardMode {
+    // Every thread scatters into its own copy of the input gradients
+    PerThread,
+    // Input rows are partitioned among threads, each row has a single writer
+    RowOwner,
+};
+
+enum class ForwardMode {
+    // Every sample accumulates its own feature rows
+    PerSample,
+    // The feature transformer runs once for the whole batch from its CSR view
+    Batched,
+};
+
+enum class UpdateMode {
+    // Per thread gradients are reduced and applied once per batch
+    Synchronous,
+    // As Synchronous, but the step of a batch runs while the next batch is computed on weights
+    // one step stale. Two sets of per thread gradients are kept and alternate between batches.
+    Pipelined,
+    // Every sample updates the weights it used right away, without locks or gradient copies
+    Hogwild,
+};
+
+enum class WeightPrecision {
+    // The forward pass reads the fp32 input weights
+    FP32,
+    // The forward pass reads a bf16 copy, touched rows are rounded again after the optimizer step
+    BF16,
+    // Quantization-aware training: the forward pass reads the int8 copy the quantizer exports and the
+    // gradients pass straight through to the fp32 master, whose touched rows are clamped and rounded again
+    Int8,
+};
+
+enum class MomentPrecision {
+    // fp32 Adam moments for every weight
+    FP32,
+    // Input feature moments in 8 bit blocks with per block scales, see MomentBlock
+    Int8,
+};
+
+// A (row, hidden loss) pair produced by a sample, `half` indexes the stm/nstm half of hiddenLossBuffer
+struct RowContribution {
+    int row;
+    int half;
+};
+
+class Trainer : public Memory::Arena {
 private:
     std::size_t epochSize = 1e7;
     std::string path;
@@ -28,15 +78,116 @@ private:
     float start_lambda = 1;
     float end_lambda   = 0.7;
 
+    ForwardMode  forwardMode  = ForwardMode::PerSample;
+    BackwardMode backwardMode = BackwardMode::PerThread;
+
+    MomentPrecision momentPrecision = MomentPrecision::FP32;
+    UpdateMode      updateMode      = UpdateMode::Synchronous;
+
+    // Micro-batches of getBatchSize() samples whose gradients are summed before one optimizer step
+    int accumulationSteps = 1;
+
+    // Samples ahead of the current one whose weight and gradient rows the batch loop prefetches, 0 disables it
+    int prefetchDistance = 1;
+
+    // Batched mode, accumulators of the whole batch
+    std::vector<float> batchAccumulators;
+
+    // Row owner mode, hidden losses of the whole batch and the contributions bucketed by [thread][owner].
+    // When the forward pass is batched the hidden losses overwrite the batch accumulators instead.
+    std::vector<float>                        hiddenLossBuffer;
+    std::vector<std::vector<RowContribution>> rowContributions;
+
+    void allocateBatchBuffers() {
+        const std::size_t batchValues = getBatchSize() * HIDDEN_SIZE * 2;
+        const bool        batched     = forwardMode == ForwardMode::Batched;
+        const bool        rowOwner    = backwardMode == BackwardMode::RowOwner;
+
+        batchAccumulators.resize(batched ? batchValues : 0);
+        batchAccumulators.shrink_to_fit();
+        hiddenLossBuffer.resize(rowOwner && !batched ? batchValues : 0);
+        hiddenLossBuffer.shrink_to_fit();
+        rowContributions.resize(rowOwner ? threadCount * threadCount : 0);
+    }
+
+    float* hiddenLossData() {
+        return forwardMode == ForwardMode::Batched ? batchAccumulators.data() : hiddenLossBuffer.data();
+    }
+
+    // Rows are owned in the contiguous worker slices the weights and optimizer state were first touched in
+    inline int rowOwnerOf(const int row) const {
+        return Tasks::owner(row, INPUT_SIZE);
+    }
+
+    void scatterOwnedRows();
+
+    // Workers of the task pool, fixed once the trainer is built
+    int threadCount;
+
+    // The set of per thread gradients the current batch writes, pipelined mode alternates two sets
+    int gradientSet = 0;
+
+    // Tasks of the last optimizer step, only still running in pipelined mode
+    Tasks::Group optimizerTail;
+
+    BatchGradients* currentGradients() {
+        return batchGradients.data() + gradientSet * threadCount;
+    }
+
+    // One set of per thread gradients, two in pipelined mode and none in hogwild mode. Each worker
+    // clears its own gradients first, so their pages are local to its NUMA node.
+    void allocateBatchGradients() {
+        const int sets = updateMode == UpdateMode::Hogwild ? 0 : updateMode == UpdateMode::Pipelined ? 2 : 1;
+        if (batchGradients.size() == std::size_t(sets * threadCount)) {
+            return;
+        }
+
+        batchGradients.clear();
+        batchGradients.shrink_to_fit();
+        batchGradients.reserve(sets * threadCount);
+        for (int i = 0; i < sets * threadCount; ++i) {
+            batchGradients.emplace_back(false);
+        }
+
+        Tasks::pool().onEachWorker([this, sets](const int worker) {
+            for (int set = 0; set < sets; ++set) {
+                batchGradients[set * threadCount + worker].clearAll();
+            }
+        });
+    }
+
+    // Optimizer steps for the optimizer selected in `optimizer`
+    template<typename Opt>
+    void applyGradients(Opt& optimizer, Tasks::Group& tail);
+    template<typename Opt>
+    void optimizeParameters(const Opt& optimizer, std::size_t offset, const float* const* gradients, int count, int size);
+    template<typename Opt>
+    void optimizeHiddenBias(const Opt& optimizer, float gradient);
+    template<typename Opt>
+    void catchUpRow(const Opt& optimizer, int row, std::int64_t skipped);
+    template<typename Opt>
+    void catchUpRows(const Opt& optimizer);
+    template<typename Opt>
+    void hogwildBatch(Opt& optimizer);
+
+    void allocateOptimizerState() {
+        const bool momentumOnly = std::holds_alternative<Optimizer::Lion>(optimizer);
+        const bool quantized    = momentPrecision == MomentPrecision::Int8;
+
+        nnGradients.setLayout(momentumOnly ? StateLayout::Momentum : quantized ? StateLayout::QuantizedMoments : StateLayout::Moments);
+    }
+
 public:
     DataLoader::DataSetLoader              dataSetLoader;
     DataLoader::DataSetLoader              valDataSetLoader;
     NN                                     nn;
     NNGradients                            nnGradients;
-    std::vector<BatchGradients>            batchGradients;
+    Memory::Vector<BatchGradients>         batchGradients;
+    std::vector<DenseGradients>            denseGradients;
+    std::vector<int>                       touchedRows;
     std::vector<float>                     losses;
     LearningRateScheduler::ExponentialDecay lrScheduler;
-    Optimizer::AdamW                        optimizer;
+    Optimizer::Any                          optimizer;
 
     // clang-format off
     Trainer(const std::string& _path, const std::size_t _batchSize, const std::string& val_path = "") : 
@@ -44,18 +195,32 @@ public:
         path(_path), 
         lrScheduler{learningRate, lrDecay}, optimizer() {
             
-        batchGradients.resize(THREADS);
-        losses.resize(THREADS);
+        threadCount = Tasks::threads();
+        allocateBatchGradients();
+        touchedRows.reserve(INPUT_SIZE);
+        losses.resize(threadCount);
+        denseGradients.resize(threadCount);
         nnGradients.clear();
     }
     // clang-format on
 
     void   clearGradientsAndLosses();
     void   train();
-    void   batch(std::array<uint8_t, INPUT_SIZE>& active);
-    void   applyGradients(std::array<uint8_t, INPUT_SIZE>& active);
+    // One optimizer step over accumulationSteps micro-batches, returns the summed loss of their samples.
+    // A pipelined step may still be running when it returns.
+    double step();
+    void   batch();
+    void   hogwildBatch();
+    void   collectTouchedRows();
+    // Spawns the optimizer step of the collected rows into tail
+    void   applyGradients(Tasks::Group& tail);
+    void   catchUpRows();
     void   validationBatch(std::vector<float>&);
     double validate();
+    // Evaluations of the exported network vs the float one over the current validation batch
+    QuantizationError quantizationError();
+    // Sparsity of the hidden losses of every thread since the last call, resets it
+    Sparsity          takeSparsity();
 
     std::size_t getBatchSize() const {
         return dataSetLoader.m_batchSize;
@@ -172,7 +337,81 @@ public:
         lrDecay         = _lrDecay;
     }
 
+    void setForwardMode(const ForwardMode _forwardMode) {
+        forwardMode = _forwardMode;
+        allocateBatchBuffers();
+    }
+
+    auto getForwardMode() const {
+        return forwardMode;
+    }
+
+    void setBackwardMode(const BackwardMode _backwardMode) {
+        backwardMode = _backwardMode;
+        allocateBatchBuffers();
+    }
+
+    auto getBackwardMode() const {
+        return backwardMode;
+    }
+
+    void setWeightPrecision(const WeightPrecision _weightPrecision) {
+        nn.setBF16(_weightPrecision == WeightPrecision::BF16);
+        nn.setInt8(_weightPrecision == WeightPrecision::Int8);
+    }
+
+    auto getWeightPrecision() const {
+        return nn.isBF16() ? WeightPrecision::BF16 : nn.isInt8() ? WeightPrecision::Int8 : WeightPrecision::FP32;
+    }
+
+    // Both reset the optimizer state. Int8 moments have no effect on momentum only optimizers.
+    void setMomentPrecision(const MomentPrecision _momentPrecision) {
+        momentPrecision = _momentPrecision;
+        allocateOptimizerState();
+    }
+
+    auto getMomentPrecision() const {
+        return momentPrecision;
+    }
+
+    void setOptimizer(const Optimizer::Any& _optimizer) {
+        optimizer = _optimizer;
+        allocateOptimizerState();
+    }
+
+    // Hogwild mode has no per thread gradient copies, pipelined mode has two sets of them
+    void setUpdateMode(const UpdateMode _updateMode) {
+        updateMode  = _updateMode;
+        gradientSet = 0;
+        allocateBatchGradients();
+    }
+
+    auto getUpdateMode() const {
+        return updateMode;
+    }
+
+    void setAccumulationSteps(const int _accumulationSteps) {
+        accumulationSteps = std::max(1, _accumulationSteps);
+    }
+
+    auto getAccumulationSteps() const {
+        return accumulationSteps;
+    }
+
+    void setPrefetchDistance(const int _prefetchDistance) {
+        prefetchDistance = std::max(0, _prefetchDistance);
+    }
+
+    auto getPrefetchDistance() const {
+        return prefetchDistance;
+    }
+
     void setRandomFenSkipping(const int _random_fen_skipping) {
         dataSetLoader.m_random_fen_skipping = _random_fen_skipping;
     }
+
+    // Validation data is always read in file order
+    void setRandomChunkOrder(const bool _randomChunkOrder) {
+        dataSetLoader.setRandomChunkOrder(_randomChunkOrder);
+    }
 };
\ No newline at end of file
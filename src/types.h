@@ -16,7 +16,15 @@ constexpr int OUTPUT_SIZE = 1;
 constexpr float EVAL_SCALE = 400.0f;
 constexpr float EVAL_CP_RATIO = 0.7f;
 
-constexpr int THREADS = 8;
+// Scales of the quantized network, the input layer is stored in units of 1 / Q1 and the hidden layer in units of 1 / Q2
+constexpr int Q1 = 181;
+constexpr int Q2 = 128;
+
+// Input weights of an int8 feature transformer, clamped to INT8_WEIGHT_LIMIT / Q1 during quantization-aware training
+constexpr int INT8_WEIGHT_LIMIT = 127;
+
+// Upper bound of --threads, sizes the per thread pointer arrays of the gradient reduction
+constexpr int MAX_THREADS = 256;
 
 constexpr std::size_t EPOCH_SIZE = 1e8;
 constexpr std::size_t VAL_EPOCH_SIZE = 1e7;